@@ -0,0 +1,240 @@
+/* pspi -- a GIMP plug-in to interface to Photoshop plug-ins.
+ *
+ * Copyright (C) 2001 Tor Lillqvist
+ * Copyright (C) 2016 Ben Touchette
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libgimp/gimp.h>
+#include <glib/gstdio.h>
+
+#ifndef G_OS_WIN32
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+#include "history.h"
+#include "main.h"
+#include "plugin-intl.h"
+
+/* The pspihistory file has one line per filter run:
+ *
+ *   pdb-name width height planes wall-time host-time bytes
+ *
+ * Runs that the watchdog had to terminate are logged as
+ *
+ *   pdb-name timeout selector seconds
+ *
+ * Only the most recent lines of each kind for each filter are kept.
+ */
+
+#define PSPIHISTORY "pspihistory"
+#define HISTORY_LENGTH 8
+
+static gchar **
+read_history (void)
+{
+	gchar *name = gimp_personal_rc_file (PSPIHISTORY);
+	gchar *contents;
+	gchar **lines;
+
+	if (!g_file_get_contents (name, &contents, NULL, NULL))
+		contents = g_strdup ("");
+	g_free (name);
+
+	lines = g_strsplit (contents, "\n", 0);
+	g_free (contents);
+
+	return lines;
+}
+
+/* Replace the file with a new one in one go, so that pspi processes
+ * running side by side never see it half written. Each writes its
+ * own temporary file.
+ */
+static gboolean
+write_history (const GString *s)
+{
+	gchar *name = gimp_personal_rc_file (PSPIHISTORY);
+	gchar *temp = g_strdup_printf ("%s.%d", name, (gint) getpid ());
+	gboolean retval = FALSE;
+	FILE *f;
+
+	if ((f = fopen (temp, "wb")) != NULL)
+		{
+			retval = (fwrite (s->str, 1, s->len, f) == s->len);
+			if (fclose (f) != 0)
+				retval = FALSE;
+			if (retval)
+				retval = (g_rename (temp, name) == 0);
+			if (!retval)
+				g_unlink (temp);
+		}
+	g_free (temp);
+	g_free (name);
+
+	return retval;
+}
+
+static gboolean
+is_timeout (const gchar *line,
+            const gchar *pdb_name)
+{
+	gchar **fields = g_strsplit (line, " ", 0);
+	gboolean retval;
+
+	retval = (g_strv_length (fields) == 4 &&
+	          strcmp (fields[0], pdb_name) == 0 &&
+	          strcmp (fields[1], "timeout") == 0);
+	g_strfreev (fields);
+
+	return retval;
+}
+
+static gboolean
+parse_run (const gchar *line,
+           const gchar *pdb_name,
+           PspiRun     *run)
+{
+	gchar **fields = g_strsplit (line, " ", 0);
+	gboolean retval = FALSE;
+
+	if (g_strv_length (fields) == 7 &&
+	        strcmp (fields[0], pdb_name) == 0)
+		{
+			run->width = atoi (fields[1]);
+			run->height = atoi (fields[2]);
+			run->planes = atoi (fields[3]);
+			run->wall_time = g_ascii_strtod (fields[4], NULL);
+			run->host_time = g_ascii_strtod (fields[5], NULL);
+			run->bytes = g_ascii_strtoull (fields[6], NULL, 10);
+			retval = (run->width > 0 && run->height > 0 && run->planes > 0);
+		}
+	g_strfreev (fields);
+
+	return retval;
+}
+
+/* Add a line for the filter, dropping its oldest lines of the same
+ * kind beyond HISTORY_LENGTH.
+ */
+static gboolean
+history_add (const gchar *pdb_name,
+             const gchar *line,
+             gboolean     timeout)
+{
+	gchar **lines = read_history ();
+	GString *s = g_string_new ("");
+	PspiRun run;
+	gboolean retval;
+	gint i, n, kept;
+
+	/* Count our earlier lines so that the oldest ones can be dropped */
+	for (i = n = 0; lines[i] != NULL; i++)
+		if (timeout ? is_timeout (lines[i], pdb_name) : parse_run (lines[i], pdb_name, &run))
+			n++;
+
+	for (i = kept = 0; lines[i] != NULL; i++)
+		{
+			if (*lines[i] == '\0')
+				continue;
+			if ((timeout ? is_timeout (lines[i], pdb_name) : parse_run (lines[i], pdb_name, &run)) &&
+			        kept++ < n - (HISTORY_LENGTH - 1))
+				continue;
+			g_string_append_printf (s, "%s\n", lines[i]);
+		}
+	g_strfreev (lines);
+
+	g_string_append_printf (s, "%s\n", line);
+	retval = write_history (s);
+	g_string_free (s, TRUE);
+
+	return retval;
+}
+
+void
+history_record (const gchar   *pdb_name,
+                const PspiRun *run)
+{
+	gchar wall[G_ASCII_DTOSTR_BUF_SIZE], host[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar *line;
+
+	line = g_strdup_printf ("%s %d %d %d %s %s %" G_GUINT64_FORMAT,
+	                        pdb_name, run->width, run->height, run->planes,
+	                        g_ascii_dtostr (wall, sizeof (wall), run->wall_time),
+	                        g_ascii_dtostr (host, sizeof (host), run->host_time),
+	                        run->bytes);
+	if (!history_add (pdb_name, line, FALSE))
+		g_message (_("Could not write %s"), PSPIHISTORY);
+	g_free (line);
+}
+
+/* Called from the watchdog thread just before terminating, so no
+ * messages.
+ */
+void
+history_record_timeout (const gchar *pdb_name,
+                        const gchar *selector,
+                        gint         limit)
+{
+	gchar *line = g_strdup_printf ("%s timeout %s %d", pdb_name, selector, limit);
+
+	history_add (pdb_name, line, TRUE);
+	g_free (line);
+}
+
+/* Expected wall time in seconds for filtering an area of the given
+ * size, from the throughput of the earlier runs. Negative if the
+ * filter hasn't been run yet.
+ */
+gdouble
+history_estimate (const gchar *pdb_name,
+                  gint         width,
+                  gint         height,
+                  gint         planes)
+{
+	gchar **lines = read_history ();
+	gdouble time = 0, samples = 0;
+	PspiRun run;
+	gint i;
+
+	for (i = 0; lines[i] != NULL; i++)
+		if (parse_run (lines[i], pdb_name, &run))
+			{
+				time += run.wall_time;
+				samples += (gdouble) run.width * run.height * run.planes;
+			}
+	g_strfreev (lines);
+
+	if (samples == 0)
+		return -1;
+
+	return time / samples * width * height * planes;
+}
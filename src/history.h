@@ -0,0 +1,53 @@
+/* pspi -- a GIMP plug-in to interface to Photoshop plug-ins.
+ *
+ * Copyright (C) 2001 Tor Lillqvist
+ * Copyright (C) 2016 Ben Touchette
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+/* One filter run, as remembered in the pspihistory file */
+typedef struct
+{
+	gint width, height;	/* Of the filtered area */
+	gint planes;
+	gdouble wall_time;	/* Seconds, whole run */
+	gdouble host_time;	/* Seconds spent in pspi's callbacks */
+	guint64 bytes;		/* Pixel data moved in and out */
+} PspiRun;
+
+void    history_record   (const gchar   *pdb_name,
+                          const PspiRun *run);
+
+void    history_record_timeout (const gchar *pdb_name,
+                                const gchar *selector,
+                                gint         limit);
+
+gdouble history_estimate (const gchar   *pdb_name,
+                          gint           width,
+                          gint           height,
+                          gint           planes);
+
+#endif /* __HISTORY_H__ */
@@ -40,6 +40,7 @@
 
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
+#include <glib/gstdio.h>
 
 #ifdef G_OS_WIN32
 #include <process.h>
@@ -49,6 +50,7 @@
 #include <windows.h>
 #undef STRICT
 
+#include "history.h"
 #include "interface.h"
 #include "main.h"
 #include "pspi.h"
@@ -58,11 +60,20 @@
 /*  Constants  */
 
 #define PSPI_PATH_TOKEN "pspi-path"
+#define PSPI_AUTOTUNE_TOKEN "pspi-autotune"
+#define PSPI_RESIDENT_TOKEN "pspi-resident"
 #define PSPIRC "pspirc"
+#define PSPILEARNED "pspilearned"
+#define LEARNED_LOCK_TRIES 100		/* 20 ms apart */
 // Originally 20000000
 #define DEBUGGER_SLEEP_TIME 5000000
 
 #define PSPI_SETTINGS_NAME "pspi_settings"
+#define PSPI_ESTIMATE_NAME "pspi_estimate"
+#define PSPI_MEMORY_STATS_NAME "pspi_memory_stats"
+#define PSPI_RUN_NAME "pspi_run"
+#define PSPI_HOST_NAME "extension_pspi_host"
+#define PSPI_HOST_RUN_NAME "pspi_host_run"
 
 #define HELP_ABOUT_PREFIX "help_about_"
 
@@ -115,6 +126,70 @@ static GimpParamDef pspi_settings_args[] =
 static gint pspi_settings_nargs =
     sizeof (pspi_settings_args) / sizeof (pspi_settings_args[0]);
 
+static GimpParamDef pspi_estimate_args[] =
+{
+	{ GIMP_PDB_INT32,    "run_mode",   "Interactive, non-interactive"       },
+	{ GIMP_PDB_STRING,   "procedure",  "PDB name of the Photoshop filter"   },
+	{ GIMP_PDB_INT32,    "width",      "Width of the area to filter"        },
+	{ GIMP_PDB_INT32,    "height",     "Height of the area to filter"       },
+	{ GIMP_PDB_INT32,    "bpp",        "Bytes per pixel of the drawable"    }
+};
+static gint pspi_estimate_nargs =
+    sizeof (pspi_estimate_args) / sizeof (pspi_estimate_args[0]);
+
+static GimpParamDef pspi_estimate_return_vals[] =
+{
+	{ GIMP_PDB_FLOAT,    "seconds",    "Expected run time, negative if unknown" }
+};
+static gint pspi_estimate_nreturn_vals =
+    sizeof (pspi_estimate_return_vals) / sizeof (pspi_estimate_return_vals[0]);
+
+static GimpParamDef pspi_memory_stats_args[] =
+{
+	{ GIMP_PDB_INT32,    "run_mode",   "Interactive, non-interactive"       },
+	{ GIMP_PDB_STRING,   "procedure",  "PDB name of the Photoshop filter"   }
+};
+static gint pspi_memory_stats_nargs =
+    sizeof (pspi_memory_stats_args) / sizeof (pspi_memory_stats_args[0]);
+
+static GimpParamDef pspi_memory_stats_return_vals[] =
+{
+	{ GIMP_PDB_FLOAT,    "peak",       "Peak bytes in use, negative if unknown" },
+	{ GIMP_PDB_FLOAT,    "staging",    "Peak bytes of pixel data passed to the filter" },
+	{ GIMP_PDB_FLOAT,    "handles",    "Peak bytes in handles"              },
+	{ GIMP_PDB_FLOAT,    "buffers",    "Peak bytes in buffers"              },
+	{ GIMP_PDB_FLOAT,    "blocks",     "Peak bytes in SPBasic blocks"       },
+	{ GIMP_PDB_INT32,    "allocations", "Number of allocations"             }
+};
+static gint pspi_memory_stats_nreturn_vals =
+    sizeof (pspi_memory_stats_return_vals) / sizeof (pspi_memory_stats_return_vals[0]);
+
+static GimpParamDef pspi_run_args[] =
+{
+	{ GIMP_PDB_INT32,    "run_mode",   "Interactive, non-interactive"       },
+	{ GIMP_PDB_IMAGE,    "image",      "Input image (unused)"               },
+	{ GIMP_PDB_DRAWABLE, "drawable",   "Input drawable"                     },
+	{ GIMP_PDB_STRING,   "procedure",  "PDB name of the Photoshop filter"   },
+	{ GIMP_PDB_STRING,   "preset",     "Name of parameter preset to use (non-interactive) or save (interactive), or empty" },
+	{ GIMP_PDB_INT32,    "n_parameters", "Length of parameters, 0 for none" },
+	{ GIMP_PDB_INT8ARRAY, "parameters", "Filter parameters as returned by an earlier call" }
+};
+static gint pspi_run_nargs =
+    sizeof (pspi_run_args) / sizeof (pspi_run_args[0]);
+
+static GimpParamDef pspi_run_return_vals[] =
+{
+	{ GIMP_PDB_INT32,    "n_parameters", "Length of parameters"             },
+	{ GIMP_PDB_INT8ARRAY, "parameters", "The filter parameters that were used" }
+};
+static gint pspi_run_nreturn_vals =
+    sizeof (pspi_run_return_vals) / sizeof (pspi_run_return_vals[0]);
+
+static GimpParamDef pspi_host_args[] =
+{
+	{ GIMP_PDB_INT32,    "run_mode",   "Interactive, non-interactive"       }
+};
+
 MAIN ()
 
 gchar *
@@ -187,6 +262,11 @@ add_entry_to_plugin (PSPlugIn *pspi,
 	pspie->menu_path = g_strdup (menu_path);
 	pspie->image_types = g_strdup (image_types);
 	pspie->entrypoint_name = g_strdup (entrypoint);
+	pspie->in_place = FALSE;
+	pspie->compare_output = FALSE;
+	pspie->tile_size = 0;
+	pspie->access_profile = NULL;
+	pspie->time_limit = 0;
 	pspie->entry = NULL;
 
 	pspi->entries = g_list_append (pspi->entries, pspie);
@@ -227,8 +307,15 @@ save_pspirc_entry (gpointer key,
 			pspie = list->data;
 			list = list->next;
 
-			fprintf (pspirc, "    <entrypoint name=\"%s\" menu-path=\"%s\" image-types=\"%s\" entrypoint=\"%s\"/>\n",
+			fprintf (pspirc, "    <entrypoint name=\"%s\" menu-path=\"%s\" image-types=\"%s\" entrypoint=\"%s\"",
 			         pspie->name, pspie->menu_path, pspie->image_types, pspie->entrypoint_name);
+			if (pspie->in_place)
+				fprintf (pspirc, " in-place=\"yes\"");
+			if (pspie->compare_output)
+				fprintf (pspirc, " compare-output=\"yes\"");
+			if (pspie->time_limit > 0)
+				fprintf (pspirc, " time-limit=\"%d\"", pspie->time_limit);
+			fprintf (pspirc, "/>\n");
 		}
 
 	fprintf (pspirc, "  </ps-plug-in>\n");
@@ -291,6 +378,11 @@ start_element_handler (GMarkupParseContext *context,
 	         depth == 2)
 		{
 			gchar *name = NULL, *menu_path = NULL, *image_types = NULL, *entrypoint = NULL;
+			gboolean in_place = FALSE;
+			gboolean compare_output = FALSE;
+			gint tile_size = 0;
+			gchar *access_profile = NULL;
+			gint time_limit = 0;
 
 			i = 0;
 			while (attribute_names[i] != NULL)
@@ -300,7 +392,7 @@ start_element_handler (GMarkupParseContext *context,
 							set_error (context, error);
 						else
 							name = g_strdup (attribute_values[i]);
-					if (strcmp (attribute_names[i], "menu-path") == 0)
+					else if (strcmp (attribute_names[i], "menu-path") == 0)
 						if (menu_path != NULL)
 							set_error (context, error);
 						else
@@ -315,6 +407,19 @@ start_element_handler (GMarkupParseContext *context,
 							set_error (context, error);
 						else
 							entrypoint = g_strdup (attribute_values[i]);
+					else if (strcmp (attribute_names[i], "in-place") == 0)
+						in_place = (strcmp (attribute_values[i], "yes") == 0);
+					else if (strcmp (attribute_names[i], "compare-output") == 0)
+						compare_output = (strcmp (attribute_values[i], "yes") == 0);
+					else if (strcmp (attribute_names[i], "tile-size") == 0)
+						tile_size = atoi (attribute_values[i]);
+					else if (strcmp (attribute_names[i], "access") == 0)
+						if (access_profile != NULL)
+							set_error (context, error);
+						else
+							access_profile = g_strdup (attribute_values[i]);
+					else if (strcmp (attribute_names[i], "time-limit") == 0)
+						time_limit = atoi (attribute_values[i]);
 					else
 						set_error (context, error);
 					i++;
@@ -325,8 +430,16 @@ start_element_handler (GMarkupParseContext *context,
 			else
 				{
 					gchar *pdb_name = make_pdb_name (ud->pspi->location, entrypoint);
+					PSPlugInEntry *pspie;
+
 					add_entry_to_plugin (ud->pspi, name, pdb_name, menu_path,
 					                     image_types, entrypoint);
+					pspie = g_list_last (ud->pspi->entries)->data;
+					pspie->in_place = in_place;
+					pspie->compare_output = compare_output;
+					pspie->tile_size = MAX (tile_size, 0);
+					pspie->access_profile = access_profile;
+					pspie->time_limit = MAX (time_limit, 0);
 				}
 		}
 	else
@@ -350,10 +463,130 @@ end_element_handler (GMarkupParseContext *context,
 		}
 }
 
+/* What pspi learns about filters by running them is kept apart from
+ * pspirc, in the pspilearned file, one line per filter:
+ *
+ *   pdb-name tile-size access
+ *
+ * with 0 and - for not known yet. Filter processes run side by side,
+ * so it is updated one line at a time under a lock, rather than
+ * rewritten from what a process read at its start.
+ */
+static gchar **
+read_learned (void)
+{
+	gchar *name = gimp_personal_rc_file (PSPILEARNED);
+	gchar *contents;
+	gchar **lines;
+
+	if (!g_file_get_contents (name, &contents, NULL, NULL))
+		contents = g_strdup ("");
+	g_free (name);
+
+	lines = g_strsplit (contents, "\n", 0);
+	g_free (contents);
+
+	return lines;
+}
+
+static void
+load_learned (void)
+{
+	gchar **lines = read_learned ();
+	gint i;
+
+	for (i = 0; lines[i] != NULL; i++)
+		{
+			gchar **fields = g_strsplit (lines[i], " ", 0);
+			PSPlugInEntry *pspie;
+
+			if (g_strv_length (fields) == 3 &&
+			        (pspie = g_hash_table_lookup (entry_hash, fields[0])) != NULL)
+				{
+					pspie->tile_size = MAX (atoi (fields[1]), 0);
+					g_free (pspie->access_profile);
+					pspie->access_profile = (strcmp (fields[2], "-") == 0 ?
+					                         NULL : g_strdup (fields[2]));
+				}
+			g_strfreev (fields);
+		}
+	g_strfreev (lines);
+}
+
+/* Only one process at a time may update the file. The lock goes away
+ * with the handle, even if the process dies.
+ */
+static HANDLE
+learned_lock (void)
+{
+	gchar *name = gimp_personal_rc_file (PSPILEARNED ".lock");
+	HANDLE lock = INVALID_HANDLE_VALUE;
+	gint i;
+
+	for (i = 0; i < LEARNED_LOCK_TRIES; i++)
+		{
+			lock = CreateFile (name, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+			                   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE,
+			                   NULL);
+			if (lock != INVALID_HANDLE_VALUE ||
+			        GetLastError () != ERROR_SHARING_VIOLATION)
+				break;
+			Sleep (20);
+		}
+	g_free (name);
+
+	return lock;
+}
+
+/* Store what was learned about the filter, leaving the other
+ * filters' lines as they are in the file now.
+ */
+void
+save_learned (const PSPlugInEntry *pspie)
+{
+	gchar *name, *temp;
+	gchar **lines;
+	GString *s;
+	HANDLE lock;
+	gint i;
+
+	if ((lock = learned_lock ()) == INVALID_HANDLE_VALUE)
+		{
+			PSPI_DEBUG (PSPIRC, g_print ("Could not lock %s, not saved\n", PSPILEARNED));
+			return;
+		}
+
+	lines = read_learned ();
+	s = g_string_new ("");
+	for (i = 0; lines[i] != NULL; i++)
+		{
+			gsize n = strlen (pspie->pdb_name);
+
+			if (*lines[i] == '\0' ||
+			        (strncmp (lines[i], pspie->pdb_name, n) == 0 && lines[i][n] == ' '))
+				continue;
+			g_string_append_printf (s, "%s\n", lines[i]);
+		}
+	g_strfreev (lines);
+	g_string_append_printf (s, "%s %d %s\n", pspie->pdb_name, pspie->tile_size,
+	                        pspie->access_profile != NULL ? pspie->access_profile : "-");
+
+	name = gimp_personal_rc_file (PSPILEARNED);
+	temp = g_strconcat (name, ".new", NULL);
+	if (!g_file_set_contents (temp, s->str, s->len, NULL) ||
+	        g_rename (temp, name) != 0)
+		g_message (_("Could not write %s"), name);
+	g_free (temp);
+	g_free (name);
+	g_string_free (s, TRUE);
+
+	CloseHandle (lock);
+}
+
 static void
 get_saved_plugin_data (void)
 {
-	gchar *pspirc_name = gimp_personal_rc_file (PSPIRC);
+	gchar *pspirc_name;
 	gchar *contents;
 	gsize length;
 	GMarkupParseContext *context;
@@ -367,6 +600,11 @@ get_saved_plugin_data (void)
 	};
 	UserData user_data;
 
+	/* The resident host reads it only once */
+	if (entry_hash != NULL)
+		return;
+
+	pspirc_name = gimp_personal_rc_file (PSPIRC);
 	plug_in_hash = g_hash_table_new (g_str_hash, g_str_equal);
 	entry_hash = g_hash_table_new (g_str_hash, g_str_equal);
 
@@ -390,6 +628,50 @@ get_saved_plugin_data (void)
 	g_free (contents);
 	g_markup_parse_context_end_parse (context, NULL);
 	g_markup_parse_context_free (context);
+
+	load_learned ();
+}
+
+void
+save_pspirc (void)
+{
+	gchar *pspirc_name = gimp_personal_rc_file (PSPIRC);
+	gchar *temp_name = g_strconcat (pspirc_name, ".new", NULL);
+	gchar *bak_name = g_strconcat (pspirc_name, ".bak", NULL);
+	FILE *pspirc = fopen (temp_name, "w");
+
+	if (pspirc == NULL)
+		g_message (_("Could not open %s for writing"), temp_name);
+	else
+		{
+			PSPI_DEBUG (PSPIRC, g_print ("Saving pspirc file\n"));
+			fprintf (pspirc, "<pspi-settings>\n");
+			g_hash_table_foreach (plug_in_hash, save_pspirc_entry, pspirc);
+			fprintf (pspirc, "</pspi-settings>\n");
+			PSPI_DEBUG (PSPIRC, g_print ("\n"));
+			fclose (pspirc);
+			remove (bak_name);
+			if (g_file_test (pspirc_name, G_FILE_TEST_EXISTS) &&
+			        rename (pspirc_name, bak_name) != 0)
+				g_message (_("Could not rename %s to %s"),
+				           pspirc_name, bak_name);
+			else
+				{
+					if (rename (temp_name, pspirc_name) != 0)
+						{
+							g_message (_("Could not rename %s to %s"),
+							           temp_name, pspirc_name);
+							if (rename (bak_name, pspirc_name) != 0)
+								g_message (_("Could not rename %s to %s"),
+								           bak_name, pspirc_name);
+						}
+					else
+						remove (bak_name);
+				}
+		}
+	g_free (pspirc_name);
+	g_free (temp_name);
+	g_free (bak_name);
 }
 
 static gint
@@ -595,6 +877,8 @@ setup_debug_mask (void)
 					BIT (DEBUGGER);
 					BIT (PIPL);
 					BIT (CALL);
+					BIT (TILE_CACHE);
+					BIT (MEMORY);
 					BIT (MISC_CALLBACKS);
 					BIT (ALL);
 					BIT (VERBOSE);
@@ -641,45 +925,7 @@ init (void)
 
 	/* Rewrite the pspirc file if necessary */
 	if (pspirc_values_modified)
-		{
-			gchar *pspirc_name = gimp_personal_rc_file (PSPIRC);
-			gchar *temp_name = g_strconcat (pspirc_name, ".new", NULL);
-			gchar *bak_name = g_strconcat (pspirc_name, ".bak", NULL);
-			FILE *pspirc = fopen (temp_name, "w");
-
-			if (pspirc == NULL)
-				g_message (_("Could not open %s for writing"), temp_name);
-			else
-				{
-					PSPI_DEBUG (PSPIRC, g_print ("Saving pspirc file\n"));
-					fprintf (pspirc, "<pspi-settings>\n");
-					g_hash_table_foreach (plug_in_hash, save_pspirc_entry, pspirc);
-					fprintf (pspirc, "</pspi-settings>\n");
-					PSPI_DEBUG (PSPIRC, g_print ("\n"));
-					fclose (pspirc);
-					remove (bak_name);
-					if (g_file_test (pspirc_name, G_FILE_TEST_EXISTS) &&
-					        rename (pspirc_name, bak_name) != 0)
-						g_message (_("Could not rename %s to %s"),
-						           pspirc_name, bak_name);
-					else
-						{
-							if (rename (temp_name, pspirc_name) != 0)
-								{
-									g_message (_("Could not rename %s to %s"),
-									           temp_name, pspirc_name);
-									if (rename (bak_name, pspirc_name) != 0)
-										g_message (_("Could not rename %s to %s"),
-										           bak_name, pspirc_name);
-								}
-							else
-								remove (bak_name);
-						}
-				}
-			g_free (pspirc_name);
-			g_free (temp_name);
-			g_free (bak_name);
-		}
+		save_pspirc ();
 
 	if (old_handler == GIMP_CONSOLE)
 		gimp_message_set_handler (GIMP_CONSOLE);
@@ -701,6 +947,54 @@ query (void)
 	                        GIMP_PLUGIN,
 	                        pspi_settings_nargs, 0,
 	                        pspi_settings_args, NULL);
+
+	gimp_install_procedure (PSPI_ESTIMATE_NAME,
+	                        "Estimate the run time of a Photoshop filter",
+	                        "Returns how long the given Photoshop filter is expected to take on an area of the given size, based on its earlier runs",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "2016",
+	                        NULL,
+	                        "",
+	                        GIMP_PLUGIN,
+	                        pspi_estimate_nargs, pspi_estimate_nreturn_vals,
+	                        pspi_estimate_args, pspi_estimate_return_vals);
+
+	gimp_install_procedure (PSPI_MEMORY_STATS_NAME,
+	                        "Memory use of a Photoshop filter",
+	                        "Returns how much memory the given Photoshop filter used at most in its last run in this GIMP session, in all and by kind",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "2016",
+	                        NULL,
+	                        "",
+	                        GIMP_PLUGIN,
+	                        pspi_memory_stats_nargs, pspi_memory_stats_nreturn_vals,
+	                        pspi_memory_stats_args, pspi_memory_stats_return_vals);
+
+	gimp_install_procedure (PSPI_RUN_NAME,
+	                        "Run a Photoshop filter with given parameters",
+	                        "Runs the given Photoshop filter. The parameters are taken, in order of preference, from the parameters argument, from the filter's dialog when run interactively, from the named preset, or else from its last run. When run interactively with a preset name, the parameters chosen in the dialog are saved under that name. Returns the parameters used, which can be passed to later calls to run the filter the same way.",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "2016",
+	                        NULL,
+	                        "RGB*, GRAY*",
+	                        GIMP_PLUGIN,
+	                        pspi_run_nargs, pspi_run_nreturn_vals,
+	                        pspi_run_args, pspi_run_return_vals);
+
+	gimp_install_procedure (PSPI_HOST_NAME,
+	                        "Resident host for Photoshop filters",
+	                        "Keeps Photoshop filter libraries loaded between runs. Started by pspi when (pspi-resident \"yes\") is in gimprc",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "2016",
+	                        NULL,
+	                        "",
+	                        GIMP_EXTENSION,
+	                        G_N_ELEMENTS (pspi_host_args), 0,
+	                        pspi_host_args, NULL);
 }
 
 static GimpPDBStatusType
@@ -765,6 +1059,59 @@ run_pspi_settings (gint             n_params,
 	return GIMP_PDB_SUCCESS;
 }
 
+static GimpPDBStatusType
+run_pspi_estimate (gint             n_params,
+                   const GimpParam *param,
+                   gdouble         *seconds)
+{
+	if (n_params != pspi_estimate_nargs ||
+	        param[2].data.d_int32 <= 0 ||
+	        param[3].data.d_int32 <= 0 ||
+	        param[4].data.d_int32 <= 0)
+		return GIMP_PDB_CALLING_ERROR;
+
+	*seconds = history_estimate (param[1].data.d_string,
+	                             param[2].data.d_int32,
+	                             param[3].data.d_int32,
+	                             param[4].data.d_int32);
+
+	return GIMP_PDB_SUCCESS;
+}
+
+static GimpPDBStatusType
+run_pspi_memory_stats (gint             n_params,
+                       const GimpParam *param,
+                       GimpParam       *values)
+{
+	PspiMemoryStats stats;
+	gint i;
+
+	if (n_params != pspi_memory_stats_nargs)
+		return GIMP_PDB_CALLING_ERROR;
+
+	if (!pspi_memory_stats (param[1].data.d_string, &stats))
+		{
+			stats.peak = 0;
+			for (i = 0; i < PSPI_MEMORY_CATEGORIES; i++)
+				stats.category_peak[i] = 0;
+			stats.allocations = 0;
+			values[0].data.d_float = -1;
+		}
+	else
+		values[0].data.d_float = stats.peak;
+	values[0].type = GIMP_PDB_FLOAT;
+
+	for (i = 0; i < PSPI_MEMORY_CATEGORIES; i++)
+		{
+			values[1 + i].type = GIMP_PDB_FLOAT;
+			values[1 + i].data.d_float = stats.category_peak[i];
+		}
+	values[1 + i].type = GIMP_PDB_INT32;
+	values[1 + i].data.d_int32 = stats.allocations;
+
+	return GIMP_PDB_SUCCESS;
+}
+
 static GimpPDBStatusType
 run_help_about (const gchar	*pdb_name,
                 gint       	 n_params,
@@ -796,58 +1143,252 @@ run_help_about (const gchar	*pdb_name,
 	return GIMP_PDB_CALLING_ERROR;
 }
 
+static gboolean
+autotune_wanted (void)
+{
+	gchar *value = gimp_gimprc_query (PSPI_AUTOTUNE_TOKEN);
+	gboolean retval = (value != NULL && strcmp (value, "yes") == 0);
+
+	g_free (value);
+	return retval;
+}
+
+/* Run a filter. The parameters come from the given block, the
+ * filter's dialog (saved to the named preset, if any), the named
+ * preset or its last run, in that order.
+ */
 static GimpPDBStatusType
-run_pspi (const gchar  	  *pdb_name,
-          gint       	   n_params,
-          const GimpParam *param)
+run_filter (PSPlugInEntry *pspie,
+            GimpRunMode    run_mode,
+            gint32         drawable_id,
+            const gchar   *preset,
+            const guint8  *parameters,
+            gint           n_parameters)
 {
-	GimpRunMode run_mode = param[0].data.d_int32;
 	GimpDrawable *drawable;
 	GimpPDBStatusType status = GIMP_PDB_SUCCESS;
-	PSPlugInEntry *pspie;
-	gint x1, y1, x2, y2;
+	gint x, y, width, height;
+	gchar *name;
 
-	get_saved_plugin_data ();
-
-	if ((pspie = g_hash_table_lookup (entry_hash, pdb_name)) != NULL)
+	if (n_parameters > 0)
+		status = pspi_set_parameters (pspie, parameters, n_parameters);
+	else if (run_mode == GIMP_RUN_INTERACTIVE)
 		{
-			gchar *name;
+			if ((status = pspi_params (pspie)) == GIMP_PDB_SUCCESS && preset != NULL)
+				status = pspi_save_preset (pspie, preset);
+		}
+	else if (preset != NULL)
+		status = pspi_use_preset (pspie, preset);
+	if (status != GIMP_PDB_SUCCESS)
+		return status;
 
-			if (run_mode == GIMP_RUN_NONINTERACTIVE)
-				{
-					if (n_params != standard_nargs)
-						return GIMP_PDB_CALLING_ERROR;
-				}
-			else if (run_mode == GIMP_RUN_INTERACTIVE)
-				{
-					if ((status = pspi_params (pspie)) != GIMP_PDB_SUCCESS)
-						return status;
-				}
-			drawable = gimp_drawable_get (param[2].data.d_drawable);
+	drawable = gimp_drawable_get (drawable_id);
 
-			gimp_ui_init (PLUGIN_NAME, TRUE);
+	/* Batch runs show no dialogs, so spare them the GTK setup */
+	if (run_mode == GIMP_RUN_INTERACTIVE)
+		gimp_ui_init (PLUGIN_NAME, TRUE);
 
-			if ((status = pspi_prepare (pspie, drawable)) != GIMP_PDB_SUCCESS)
-				return status;
+	/* A filter failing on the sample gets the default tile size, its
+	 * real run tells what went wrong.
+	 */
+	if (pspie->tile_size == 0 && autotune_wanted ())
+		pspi_autotune (pspie, drawable);
 
+	status = pspi_prepare (pspie, drawable);
+
+	if (status == GIMP_PDB_SUCCESS)
+		{
 			name = g_strdup_printf (_("Applying %s:"),
 			                        strrchr (pspie->menu_path, '/') + 1);
 			gimp_progress_init (name);
 			g_free (name);
 
-			if ((status = pspi_apply (pspie, drawable)) != GIMP_PDB_SUCCESS)
-				return status;
+			status = pspi_apply (pspie, drawable);
+		}
 
+	/* If the plug-in didn't write anything, there is nothing
+	 * to merge, and no need for an undo step either.
+	 */
+	if (status == GIMP_PDB_SUCCESS &&
+	        pspi_dirty_bounds (&x, &y, &width, &height))
+		{
 			gimp_drawable_flush (drawable);
 			gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-			gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
-			gimp_drawable_update (drawable->drawable_id, x1, y1, (x2 - x1), (y2 - y1));
+			pspi_update_dirty ();
 			gimp_displays_flush ();
-
-			return GIMP_PDB_SUCCESS;
 		}
 
-	return GIMP_PDB_CALLING_ERROR;
+	/* The resident host would otherwise keep it around */
+	gimp_drawable_detach (drawable);
+
+	return status;
+}
+
+static gboolean
+resident_wanted (void)
+{
+	gchar *value = gimp_gimprc_query (PSPI_RESIDENT_TOKEN);
+	gboolean retval = (value != NULL && strcmp (value, "yes") == 0);
+
+	g_free (value);
+	return retval;
+}
+
+/* Start the resident host unless it is running already */
+static gboolean
+host_available (void)
+{
+	GimpParam *return_vals;
+	gint nreturn_vals;
+
+	if (gimp_procedural_db_proc_exists (PSPI_HOST_RUN_NAME))
+		return TRUE;
+
+	/* Returns once the host is ready */
+	return_vals = gimp_run_procedure (PSPI_HOST_NAME, &nreturn_vals,
+	                                  GIMP_PDB_INT32, GIMP_RUN_NONINTERACTIVE,
+	                                  GIMP_PDB_END);
+	gimp_destroy_params (return_vals, nreturn_vals);
+
+	return gimp_procedural_db_proc_exists (PSPI_HOST_RUN_NAME);
+}
+
+/* Have the resident host run the filter */
+static GimpPDBStatusType
+run_in_host (const gchar     *pdb_name,
+             const GimpParam *param)
+{
+	GimpParam *return_vals;
+	gint nreturn_vals;
+	GimpPDBStatusType status;
+
+	return_vals = gimp_run_procedure (PSPI_HOST_RUN_NAME, &nreturn_vals,
+	                                  GIMP_PDB_INT32, param[0].data.d_int32,
+	                                  GIMP_PDB_IMAGE, param[1].data.d_image,
+	                                  GIMP_PDB_DRAWABLE, param[2].data.d_drawable,
+	                                  GIMP_PDB_STRING, pdb_name,
+	                                  GIMP_PDB_STRING, "",
+	                                  GIMP_PDB_INT32, 0,
+	                                  GIMP_PDB_INT8ARRAY, NULL,
+	                                  GIMP_PDB_END);
+	status = return_vals[0].data.d_status;
+	gimp_destroy_params (return_vals, nreturn_vals);
+
+	return status;
+}
+
+static GimpPDBStatusType
+run_pspi (const gchar  	  *pdb_name,
+          gint       	   n_params,
+          const GimpParam *param)
+{
+	GimpRunMode run_mode = param[0].data.d_int32;
+	PSPlugInEntry *pspie;
+
+	if (run_mode == GIMP_RUN_NONINTERACTIVE && n_params != standard_nargs)
+		return GIMP_PDB_CALLING_ERROR;
+
+	if (resident_wanted () && host_available ())
+		return run_in_host (pdb_name, param);
+
+	get_saved_plugin_data ();
+
+	if ((pspie = g_hash_table_lookup (entry_hash, pdb_name)) == NULL)
+		return GIMP_PDB_CALLING_ERROR;
+
+	return run_filter (pspie, run_mode, param[2].data.d_drawable,
+	                   NULL, NULL, 0);
+}
+
+static GimpPDBStatusType
+run_pspi_run (gint             n_params,
+              const GimpParam *param,
+              GimpParam       *values)
+{
+	GimpRunMode run_mode = param[0].data.d_int32;
+	GimpPDBStatusType status;
+	PSPlugInEntry *pspie;
+	const gchar *preset = NULL;
+	gint n_parameters;
+
+	if (n_params != pspi_run_nargs || param[5].data.d_int32 < 0)
+		return GIMP_PDB_CALLING_ERROR;
+
+	get_saved_plugin_data ();
+
+	if (param[3].data.d_string == NULL ||
+	        (pspie = g_hash_table_lookup (entry_hash, param[3].data.d_string)) == NULL)
+		return GIMP_PDB_CALLING_ERROR;
+
+	if (param[4].data.d_string != NULL && *param[4].data.d_string != '\0')
+		preset = param[4].data.d_string;
+
+	status = run_filter (pspie, run_mode, param[2].data.d_drawable, preset,
+	                     param[6].data.d_int8array, param[5].data.d_int32);
+	if (status != GIMP_PDB_SUCCESS)
+		return status;
+
+	values[1].type = GIMP_PDB_INT8ARRAY;
+	values[1].data.d_int8array = pspi_get_parameters (&n_parameters);
+	values[0].type = GIMP_PDB_INT32;
+	values[0].data.d_int32 = n_parameters;
+
+	return GIMP_PDB_SUCCESS;
+}
+
+/* pspi_host_run, the resident host's way in */
+static void
+host_run (const gchar     *name,
+          gint             n_params,
+          const GimpParam *param,
+          gint            *nreturn_vals,
+          GimpParam      **return_vals)
+{
+	static GimpParam values[3];
+	GimpPDBStatusType status;
+
+	setup_debug_mask ();
+
+	g_free (values[2].data.d_int8array);
+	values[2].data.d_int8array = NULL;
+
+	*nreturn_vals = 1;
+	*return_vals = values;
+
+	status = run_pspi_run (n_params, param, values + 1);
+	if (status == GIMP_PDB_SUCCESS)
+		*nreturn_vals = 1 + pspi_run_nreturn_vals;
+	pspi_session_end ();
+
+	values[0].type = GIMP_PDB_STATUS;
+	values[0].data.d_status = status;
+}
+
+/* Stays running until GIMP quits, serving one filter run at a time */
+static void
+run_pspi_host (void)
+{
+	get_saved_plugin_data ();
+	pspi_set_resident ();
+
+	gimp_install_temp_proc (PSPI_HOST_RUN_NAME,
+	                        "Run a Photoshop filter in the resident host",
+	                        "Like pspi_run, but in the long-running pspi host process",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "Ben Touchette <draekko.software+gimp@gmail.com>",
+	                        "2016",
+	                        NULL,
+	                        "RGB*, GRAY*",
+	                        GIMP_TEMPORARY,
+	                        pspi_run_nargs, pspi_run_nreturn_vals,
+	                        pspi_run_args, pspi_run_return_vals,
+	                        host_run);
+
+	/* Lets the caller that started us go on */
+	gimp_extension_ack ();
+
+	while (TRUE)
+		gimp_extension_process (0);
 }
 
 static void
@@ -857,8 +1398,9 @@ run (const gchar     *name,
      gint            *nreturn_vals,
      GimpParam      **return_vals)
 {
-	static GimpParam values[1];
+	static GimpParam values[7];
 	GimpPDBStatusType status = GIMP_PDB_SUCCESS;
+	gdouble seconds;
 
 	setup_debug_mask ();
 
@@ -872,8 +1414,36 @@ run (const gchar     *name,
 #endif
 	textdomain (GETTEXT_PACKAGE);
 
+#ifdef HAVE_GEGL
+	gegl_init (NULL, NULL);
+#endif
+
 	if (strcmp (name, PSPI_SETTINGS_NAME) == 0)
 		status = run_pspi_settings (n_params, param);
+	else if (strcmp (name, PSPI_ESTIMATE_NAME) == 0)
+		{
+			status = run_pspi_estimate (n_params, param, &seconds);
+			if (status == GIMP_PDB_SUCCESS)
+				{
+					*nreturn_vals = 2;
+					values[1].type = GIMP_PDB_FLOAT;
+					values[1].data.d_float = seconds;
+				}
+		}
+	else if (strcmp (name, PSPI_MEMORY_STATS_NAME) == 0)
+		{
+			status = run_pspi_memory_stats (n_params, param, values + 1);
+			if (status == GIMP_PDB_SUCCESS)
+				*nreturn_vals = 1 + pspi_memory_stats_nreturn_vals;
+		}
+	else if (strcmp (name, PSPI_HOST_NAME) == 0)
+		run_pspi_host ();
+	else if (strcmp (name, PSPI_RUN_NAME) == 0)
+		{
+			status = run_pspi_run (n_params, param, values + 1);
+			if (status == GIMP_PDB_SUCCESS)
+				*nreturn_vals = 1 + pspi_run_nreturn_vals;
+		}
 	else if (strncmp (name, HELP_ABOUT_PREFIX, strlen (HELP_ABOUT_PREFIX)) == 0)
 		status = run_help_about (name, n_params, param);
 	else
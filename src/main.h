@@ -45,6 +45,11 @@ typedef struct
 	gchar *menu_path;
 	gchar *image_types;
 	gchar *entrypoint_name;
+	gboolean in_place;	/* Tolerates inData == outData */
+	gboolean compare_output;	/* Update only what it changed */
+	gint tile_size;		/* Tuned tile size, 0 if not tuned */
+	gchar *access_profile;	/* How it requests pixels, or NULL */
+	gint time_limit;	/* Seconds per selector call, 0 for default */
 	PIentrypoint *entry;
 } PSPlugInEntry;
 
@@ -63,6 +68,8 @@ extern gint debug_mask;
 #define PSPI_DEBUG_PIPL			(1<<10)
 #define PSPI_DEBUG_CALL			(1<<11)
 #define PSPI_DEBUG_PSPIRC		(1<<12)
+#define PSPI_DEBUG_TILE_CACHE		(1<<13)
+#define PSPI_DEBUG_MEMORY		(1<<14)
 #define PSPI_DEBUG_MISC_CALLBACKS	(1<<30)
 #define PSPI_DEBUG_ANY			(~0)
 #define PSPI_DEBUG_ALL			PSPI_DEBUG_ANY
@@ -101,4 +108,8 @@ void   add_entry_to_plugin (PSPlugIn    *pspi,
                             gchar       *image_types,
                             gchar       *entrypoint);
 
+void   save_pspirc         (void);
+
+void   save_learned        (const PSPlugInEntry *pspie);
+
 #endif /* __MAIN_H__ */
@@ -0,0 +1,263 @@
+/* pspi -- a GIMP plug-in to interface to Photoshop plug-ins.
+ *
+ * Copyright (C) 2001 Tor Lillqvist
+ * Copyright (C) 2016 Ben Touchette
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <libgimp/gimp.h>
+
+#include "preset.h"
+#include "main.h"
+#include "plugin-intl.h"
+
+/* Each filter's presets are kept in pspipresets/PDB-NAME, which
+ * starts with "PSPP" and a version number, followed by one record
+ * per preset:
+ *
+ *   name length, name, parameters kind, blob size, blob
+ *
+ * All numbers are 32 bits, big-endian. The plug-in's data word is
+ * not saved, as it is only meaningful within one run.
+ */
+
+#define PSPIPRESETS "pspipresets"
+#define PRESET_MAGIC "PSPP"
+#define PRESET_VERSION 1
+
+static gchar *
+preset_file (const gchar *pdb_name)
+{
+	gchar *dir = gimp_personal_rc_file (PSPIPRESETS);
+	gchar *file = g_build_filename (dir, pdb_name, NULL);
+
+	g_free (dir);
+	return file;
+}
+
+static gboolean
+read_uint32 (const guchar **p,
+             const guchar  *end,
+             guint32       *value)
+{
+	if (end - *p < 4)
+		return FALSE;
+	memcpy (value, *p, 4);
+	*value = GUINT32_FROM_BE (*value);
+	*p += 4;
+	return TRUE;
+}
+
+static void
+append_uint32 (GByteArray *out,
+               guint32     value)
+{
+	value = GUINT32_TO_BE (value);
+	g_byte_array_append (out, (guint8 *) &value, 4);
+}
+
+/* Walk the records of a preset file. Calls func for each one until
+ * it returns TRUE. Returns FALSE if the file is malformed.
+ */
+typedef gboolean (*PresetFunc) (const gchar  *name,
+                                guint         name_len,
+                                const guchar *record,
+                                guint         record_len,
+                                gpointer      user_data);
+
+static gboolean
+preset_foreach (const guchar *p,
+                gsize         size,
+                PresetFunc    func,
+                gpointer      user_data)
+{
+	const guchar *end = p + size;
+	guint32 version;
+
+	if (size < 8 || memcmp (p, PRESET_MAGIC, 4) != 0)
+		return FALSE;
+	p += 4;
+	read_uint32 (&p, end, &version);
+	if (version > PRESET_VERSION)
+		return FALSE;
+
+	while (p < end)
+		{
+			const guchar *record = p;
+			guint32 name_len, kind, blob_size;
+			const gchar *name;
+
+			if (!read_uint32 (&p, end, &name_len) || end - p < name_len)
+				return FALSE;
+			name = (const gchar *) p;
+			p += name_len;
+			if (!read_uint32 (&p, end, &kind) ||
+			    !read_uint32 (&p, end, &blob_size) ||
+			    end - p < blob_size)
+				return FALSE;
+			p += blob_size;
+
+			if ((*func) (name, name_len, record, p - record, user_data))
+				break;
+		}
+
+	return TRUE;
+}
+
+typedef struct
+{
+	const gchar *name;
+	PspiPreset *preset;	/* Where to load it */
+	GByteArray *out;	/* Or where to copy the other ones */
+	gboolean found;
+} PresetLookup;
+
+static gboolean
+preset_find (const gchar  *name,
+             guint         name_len,
+             const guchar *record,
+             guint         record_len,
+             gpointer      user_data)
+{
+	PresetLookup *lookup = user_data;
+	const guchar *p = record + 4 + name_len;
+	const guchar *end = record + record_len;
+	guint32 kind;
+
+	if (name_len != strlen (lookup->name) ||
+	    strncmp (name, lookup->name, name_len) != 0)
+		return FALSE;
+
+	/* A preset from a corrupt or foreign file counts as missing */
+	read_uint32 (&p, end, &kind);
+	if (kind > PSPI_PARAMETERS_HGLOBAL_PTR)
+		return TRUE;
+	lookup->preset->kind = kind;
+	read_uint32 (&p, end, &lookup->preset->size);
+	lookup->preset->blob = g_memdup (p, lookup->preset->size);
+	lookup->found = TRUE;
+
+	return TRUE;
+}
+
+static gboolean
+preset_copy_others (const gchar  *name,
+                    guint         name_len,
+                    const guchar *record,
+                    guint         record_len,
+                    gpointer      user_data)
+{
+	PresetLookup *lookup = user_data;
+
+	if (name_len != strlen (lookup->name) ||
+	    strncmp (name, lookup->name, name_len) != 0)
+		g_byte_array_append (lookup->out, record, record_len);
+
+	return FALSE;
+}
+
+/* Look up a preset by name. The blob is to be freed by the caller. */
+gboolean
+preset_load (const gchar *pdb_name,
+             const gchar *name,
+             PspiPreset  *preset)
+{
+	gchar *file = preset_file (pdb_name);
+	gchar *contents;
+	gsize size;
+	PresetLookup lookup;
+
+	lookup.name = name;
+	lookup.preset = preset;
+	lookup.found = FALSE;
+
+	if (g_file_get_contents (file, &contents, &size, NULL))
+		{
+			if (!preset_foreach ((guchar *) contents, size, preset_find, &lookup))
+				g_message (_("pspi: %s is not a preset file"), file);
+			g_free (contents);
+		}
+	g_free (file);
+
+	PSPI_DEBUG (CALL, g_print ("Preset %s of %s: %s\n", name, pdb_name,
+	                           lookup.found ? "found" : "not found"));
+	return lookup.found;
+}
+
+/* Store a preset, replacing any earlier one of the same name */
+gboolean
+preset_save (const gchar      *pdb_name,
+             const gchar      *name,
+             const PspiPreset *preset)
+{
+	gchar *dir = gimp_personal_rc_file (PSPIPRESETS);
+	gchar *file = preset_file (pdb_name);
+	gchar *contents;
+	gsize size;
+	GByteArray *out = g_byte_array_new ();
+	PresetLookup lookup;
+	gboolean retval = TRUE;
+
+	g_byte_array_append (out, (guint8 *) PRESET_MAGIC, 4);
+	append_uint32 (out, PRESET_VERSION);
+
+	lookup.name = name;
+	lookup.out = out;
+	if (g_file_get_contents (file, &contents, &size, NULL))
+		{
+			/* Don't overwrite what we can't read */
+			if (!preset_foreach ((guchar *) contents, size,
+			                     preset_copy_others, &lookup))
+				{
+					g_message (_("pspi: %s is not a preset file"), file);
+					retval = FALSE;
+				}
+			g_free (contents);
+		}
+
+	if (retval)
+		{
+			append_uint32 (out, strlen (name));
+			g_byte_array_append (out, (guint8 *) name, strlen (name));
+			append_uint32 (out, preset->kind);
+			append_uint32 (out, preset->size);
+			g_byte_array_append (out, preset->blob, preset->size);
+
+			g_mkdir_with_parents (dir, 0755);
+			if (!g_file_set_contents (file, (gchar *) out->data, out->len, NULL))
+				{
+					g_message (_("Could not open %s for writing"), file);
+					retval = FALSE;
+				}
+		}
+
+	g_byte_array_free (out, TRUE);
+	g_free (file);
+	g_free (dir);
+
+	return retval;
+}
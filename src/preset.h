@@ -0,0 +1,56 @@
+/* pspi -- a GIMP plug-in to interface to Photoshop plug-ins.
+ *
+ * Copyright (C) 2001 Tor Lillqvist
+ * Copyright (C) 2016 Ben Touchette
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __PRESET_H__
+#define __PRESET_H__
+
+/* How a plug-in allocated its filter.parameters */
+enum
+{
+	PSPI_PARAMETERS_NONE,
+	PSPI_PARAMETERS_HANDLE,		/* Through the Handle suite */
+	PSPI_PARAMETERS_HGLOBAL,
+	PSPI_PARAMETERS_HGLOBAL_PTR	/* Pointer to an HGLOBAL */
+};
+
+/* A named set of filter parameters */
+typedef struct
+{
+	gint kind;
+	guint size;
+	guchar *blob;
+} PspiPreset;
+
+gboolean preset_load (const gchar *pdb_name,
+                      const gchar *name,
+                      PspiPreset  *preset);
+
+gboolean preset_save (const gchar      *pdb_name,
+                      const gchar      *name,
+                      const PspiPreset *preset);
+
+#endif /* __PRESET_H__ */
@@ -27,6 +27,8 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE		/* For mremap() */
+
 #include "config.h"
 
 #include <stdlib.h>
@@ -34,6 +36,13 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#ifndef G_OS_WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include <process.h>
+#endif
+
 #define STRICT
 #include <windows.h>
 #undef STRICT
@@ -44,6 +53,8 @@
 #include <PIGeneral.h>
 #include <PIAbout.h>
 #include <PIFilter.h>
+#include <PIBufferSuite.h>
+#include <PIHandleSuite.h>
 /*
 #include <PIUtilities.h>
 #include <PIProperties.h>
@@ -51,16 +62,47 @@
 
 #include <libgimp/gimp.h>
 
+#ifdef HAVE_GEGL
+#include <gegl.h>
+#endif
+
 #include "main.h"
+#include "history.h"
+#include "preset.h"
+#include "pspi.h"
 #include "plugin-intl.h"
 
 #define RECT_NONEMPTY(r) (r.left < r.right && r.top < r.bottom)
+#define RECT_EQUAL(r, s) (r.left == s.left && r.top == s.top && r.right == s.right && r.bottom == s.bottom)
 #define PRINT_RECT(r) g_print ("%dx%d@%+d%+d", r.right-r.left, r.bottom-r.top, r.right, r.top)
 
-#define PSPI_PARAMETER_TOKEN "pspi-parameter-%s"
-#define PSPI_PARAMETER_HGLOBAL_TOKEN "pspi-parameter-hglobal-%s"
-#define PSPI_PARAMETER_HGLOBAL_PTR_TOKEN "pspi-parameter-hglobal-ptr-%s"
-#define PSPI_DATA_TOKEN "pspi-data-%s"
+#define PSPI_HANDLE_MAGIC 0x50535049	/* "PSPI" */
+#define HANDLE_SLAB_SIZE 65536		/* Handles */
+#define HANDLE_MMAP_THRESHOLD (1 << 20)	/* Bytes */
+
+#define BUFFER_MIN_CLASS_BITS 12	/* Smallest pooled buffer 4 kB */
+#define BUFFER_CLASSES (4 * (32 - BUFFER_MIN_CLASS_BITS) + 1)
+#define BUFFER_HEADER_SIZE 32
+#define BUFFER_POOL_MAX (64 << 20)	/* Bytes kept for reuse */
+
+#define PSPI_LAST_VALS_TOKEN "pspi-last-vals-%s"
+#define PSPI_MEMORY_STATS_TOKEN "pspi-memory-stats-%s"
+#define PSPI_TILE_CACHE_BUDGET_TOKEN "pspi-tile-cache-budget"
+
+#define DEFAULT_TILE_CACHE_BUDGET 256	/* Megabytes */
+
+#define AUTOTUNE_SAMPLE_SIZE 512	/* Pixels square */
+#define AUTOTUNE_RUNS 3			/* Timed runs per tile size */
+
+#define PSPI_PROGRESS_RATE_TOKEN "pspi-progress-rate"
+#define DEFAULT_PROGRESS_RATE 30	/* Updates per second */
+#define PROGRESS_MIN_DELTA 0.005
+
+#define PSPI_TIME_LIMIT_TOKEN "pspi-time-limit"
+#define PSPI_SELECTOR_TIME_LIMIT_TOKEN "pspi-selector-time-limit"
+#define PSPI_RESIDENT_BUDGET_TOKEN "pspi-resident-budget"
+#define RESIDENT_BUDGET_DEFAULT 256	/* Megabytes */
+#define SELECTOR_GRACE_TIME 5		/* Seconds after asking to abort */
 
 /* To avoid 'multi-character character constant' warnings, we use this hack: */
 
@@ -95,10 +137,19 @@ typedef struct
 
 typedef struct
 {
-	gpointer pointer;
+	gpointer pointer;	/* Must be first, plug-ins dereference handles */
 	guint size;
+	guint32 magic;
+	guint capacity;		/* Allocated for pointer */
+	gboolean mapped;	/* pointer is from mmap() */
+	gpointer owner;		/* Library it was allocated for */
 } PspiHandle;
 
+typedef struct
+{
+	gint x1, y1, x2, y2;
+} PspiRect;
+
 typedef enum { NONE, PARAMETERS, PREPARE, START, FINISH } PspiPhase;
 
 static PspiPhase prev_phase = NONE;
@@ -112,14 +163,106 @@ static PropertyProcs *property_procs = NULL;
 static ResourceProcs *resource_procs = NULL;
 static SPBasicSuite *basic_suite = NULL;
 
+/* The PICA suites plug-ins can acquire through SPBasic, by interned
+ * name. Each name maps to a list of PspiSuites, one per version.
+ */
+typedef struct
+{
+	int32 version;
+	const void *suite;
+} PspiSuite;
+
+static GHashTable *suites = NULL;
+
+/* The Property suite is just the procs of PropertyProcs */
+#define PSPI_PROPERTY_SUITE "Photoshop Property Suite for Plug-ins"
+
+typedef struct
+{
+	GetPropertyProc getPropertyProc;
+	SetPropertyProc setPropertyProc;
+} PspiPropertySuite1;
+
+/* Our handles come from one slab, so validating one is an address
+ * range and tag check. Should a plug-in use up the slab, the rest are
+ * allocated separately and kept in the handles table.
+ */
+static PspiHandle *handle_slab = NULL;
+static guint handle_slab_used = 0;
+static PspiHandle *free_handles = NULL;	/* Linked through pointer */
 static GHashTable *handles = NULL;
 
+/* Handles the plug-in got from elsewhere, by what they turned out to
+ * be: HGLOBALs or pointers to HGLOBALs.
+ */
+enum
+{
+	FOREIGN_INVALID,
+	FOREIGN_HGLOBAL,
+	FOREIGN_HGLOBAL_PTR
+};
+static GHashTable *foreign_handles = NULL;
+
+/* Live SPBasic blocks */
+typedef struct
+{
+	gsize size;
+	gpointer owner;
+} PspiBlock;
+
+static GHashTable *blocks = NULL;
+
+/* The library allocations are made for, so that the resident host
+ * can free them when it unloads that library.
+ */
+static gpointer alloc_owner = NULL;
+
+/* The image's resources, loaded on first use. Maps ResType to a
+ * GPtrArray of GByteArray, written back in one parasite at the end
+ * of the run.
+ */
+#define RESOURCES_PARASITE "pspi-resources"
+#define RESOURCES_MAGIC "PSPR"
+#define RESOURCES_VERSION 1
+
+static GHashTable *resources = NULL;
+static int32 resources_image;
+static gboolean resources_dirty;
+static gboolean resources_readonly;
+static GSList *resources_legacy = NULL; /* pspi-res-TYPE-N parasites to drop */
+
+/* What the Property suite and the FilterRecord report about the
+ * image, read once in pspi_prepare() rather than per query.
+ */
+static struct
+{
+	int32 image;			/* -1 when not taken */
+	gint num_channels;
+	gchar **channel_names;
+	gint num_paths;
+	gchar **path_names;
+	gint width, height;
+	gdouble xres, yres;
+} image_props = { -1 };
+
 /* Due to the strange design of the Photoshop API (no user data in
  * callbacks) we must keep state in global variables. Blecch.
  */
 
 static GimpDrawable *drawable;
 static int32 image_id;
+static gint pixel_bpp;		/* Bytes per pixel as seen by the plug-in */
+static gboolean in_place;
+static gboolean compare_output;	/* Snapshot outData to spot unchanged tiles */
+static gint tune_tile_size;	/* Tile size being tried, or 0 */
+static gboolean dry_run;	/* Don't store any output */
+
+/* In the resident host, libraries stay loaded between runs. Their
+ * entries, most recently used first.
+ */
+static gboolean resident = FALSE;
+static GList *resident_entries = NULL;
+static gboolean colors_current = FALSE;
 static PlatformData platform;
 static FilterRecord filter;
 static int32 data;
@@ -285,11 +428,185 @@ image_mode_string (int image_mode)
 		}
 }
 
+/* Memory in use, by what it is for */
+static struct
+{
+	gsize current, peak;
+	guint allocations;
+} memory[PSPI_MEMORY_CATEGORIES];
+static gsize memory_current, memory_peak;
+
+static void
+memory_alloc (gint  category,
+              gsize size)
+{
+	memory[category].allocations++;
+	if ((memory[category].current += size) > memory[category].peak)
+		memory[category].peak = memory[category].current;
+	if ((memory_current += size) > memory_peak)
+		memory_peak = memory_current;
+}
+
+static void
+memory_free (gint  category,
+             gsize size)
+{
+	memory[category].current -= size;
+	memory_current -= size;
+}
+
+static void
+memory_reset_peaks (void)
+{
+	gint i;
+
+	for (i = 0; i < PSPI_MEMORY_CATEGORIES; i++)
+		{
+			memory[i].peak = memory[i].current;
+			memory[i].allocations = 0;
+		}
+	memory_peak = memory_current;
+}
+
+/* Print and keep the peaks of the run, for pspi_memory_stats() */
+static void
+memory_report (const PSPlugInEntry *pspie)
+{
+	static const gchar *names[PSPI_MEMORY_CATEGORIES] =
+	{
+		"staging", "handles", "buffers", "blocks"
+	};
+	PspiMemoryStats stats;
+	gchar *token;
+	gint i;
+
+	stats.peak = memory_peak;
+	stats.allocations = 0;
+	for (i = 0; i < PSPI_MEMORY_CATEGORIES; i++)
+		{
+			stats.category_peak[i] = memory[i].peak;
+			stats.allocations += memory[i].allocations;
+			PSPI_DEBUG (MEMORY, g_print ("pspi: %s: peak %lu kB, %u allocations\n",
+			                             names[i], (gulong) (memory[i].peak >> 10),
+			                             memory[i].allocations));
+		}
+	PSPI_DEBUG (MEMORY, g_print ("pspi: peak %lu kB in all\n", (gulong) (memory_peak >> 10)));
+
+	token = g_strdup_printf (PSPI_MEMORY_STATS_TOKEN, pspie->pdb_name);
+	gimp_set_data (token, &stats, sizeof (stats));
+	g_free (token);
+}
+
+gboolean
+pspi_memory_stats (const gchar     *pdb_name,
+                   PspiMemoryStats *stats)
+{
+	gchar *token = g_strdup_printf (PSPI_MEMORY_STATS_TOKEN, pdb_name);
+	gboolean retval = FALSE;
+
+	if (gimp_get_data_size (token) == sizeof (*stats))
+		retval = gimp_get_data (token, stats);
+	g_free (token);
+
+	return retval;
+}
+
+/* Buffers are pooled by size class, four classes for each power of
+ * two, so that plug-ins allocating and freeing scratch buffers for
+ * every tile don't keep going to the system for megabytes. Each
+ * buffer has a header in front with its class.
+ */
+typedef struct _PspiBuffer PspiBuffer;
+
+struct _PspiBuffer
+{
+	PspiBuffer *next, *prev;	/* In live_buffers or a free list */
+	guint size_class;
+	guint32 size;			/* As asked for */
+	gpointer owner;
+};
+
+/* The header must leave the data aligned as malloc() would */
+G_STATIC_ASSERT (sizeof (PspiBuffer) <= BUFFER_HEADER_SIZE);
+
+static PspiBuffer *free_buffers[BUFFER_CLASSES];
+static gsize pooled_bytes = 0;
+static PspiBuffer *live_buffers = NULL;
+
+static guint
+buffer_class (gsize size)
+{
+	guint bits;
+	gsize base, step;
+
+	if (size <= 1 << BUFFER_MIN_CLASS_BITS)
+		return 0;
+
+	bits = g_bit_storage (size - 1) - 1;
+	base = (gsize) 1 << bits;
+	step = base / 4;
+
+	return (bits - BUFFER_MIN_CLASS_BITS) * 4 + (size - base + step - 1) / step;
+}
+
+static gsize
+buffer_class_size (guint size_class)
+{
+	gsize base;
+
+	if (size_class == 0)
+		return 1 << BUFFER_MIN_CLASS_BITS;
+
+	base = (gsize) 1 << ((size_class - 1) / 4 + BUFFER_MIN_CLASS_BITS);
+
+	return base + ((size_class - 1) % 4 + 1) * (base / 4);
+}
+
+static void
+buffer_pool_flush (void)
+{
+	guint i;
+
+	for (i = 0; i < BUFFER_CLASSES; i++)
+		while (free_buffers[i] != NULL)
+			{
+				PspiBuffer *b = free_buffers[i];
+
+				free_buffers[i] = b->next;
+				g_free (b);
+			}
+	pooled_bytes = 0;
+}
+
 static OSErr
 buffer_allocate_proc (int32     size,
                       BufferID *bufferID)
 {
-	*bufferID = g_malloc (size);
+	guint size_class;
+	PspiBuffer *b;
+
+	if (size < 0)
+		return memFullErr;
+
+	size_class = buffer_class (size);
+	if ((b = free_buffers[size_class]) != NULL)
+		{
+			free_buffers[size_class] = b->next;
+			pooled_bytes -= buffer_class_size (size_class);
+		}
+	else if ((b = g_try_malloc (BUFFER_HEADER_SIZE + buffer_class_size (size_class))) == NULL)
+		return memFullErr;
+
+	b->size_class = size_class;
+	b->size = size;
+	b->owner = alloc_owner;
+	memory_alloc (PSPI_MEMORY_BUFFERS, buffer_class_size (size_class));
+	b->prev = NULL;
+	b->next = live_buffers;
+	if (live_buffers != NULL)
+		live_buffers->prev = b;
+	live_buffers = b;
+	*bufferID = (BufferID) ((gchar *) b + BUFFER_HEADER_SIZE);
 	PSPI_DEBUG (BUFFER_SUITE, g_print (G_STRLOC ":%s: %ld: %p\n", __FUNCTION__, size, *bufferID));
 
 	return noErr;
@@ -313,9 +630,32 @@ buffer_unlock_proc (BufferID bufferID)
 static void
 buffer_free_proc (BufferID bufferID)
 {
+	PspiBuffer *b;
+	gsize size;
+
 	PSPI_DEBUG (BUFFER_SUITE, g_print (G_STRLOC ":%s: %p\n", __FUNCTION__, bufferID));
 
-	g_free (bufferID);
+	if (bufferID == NULL)
+		return;
+
+	b = (PspiBuffer *) ((gchar *) bufferID - BUFFER_HEADER_SIZE);
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		live_buffers = b->next;
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+
+	size = buffer_class_size (b->size_class);
+	memory_free (PSPI_MEMORY_BUFFERS, size);
+	if (pooled_bytes + size <= BUFFER_POOL_MAX)
+		{
+			b->next = free_buffers[b->size_class];
+			free_buffers[b->size_class] = b;
+			pooled_bytes += size;
+		}
+	else
+		g_free (b);
 }
 
 static int32
@@ -355,25 +695,190 @@ channel_port_read_port_for_write_port_proc (ChannelReadPort *readPort,
 	return errPlugInHostInsufficient;
 }
 
+static gboolean
+in_handle_slab (const PspiHandle *h)
+{
+	return ((gsize) h >= (gsize) handle_slab &&
+	        (gsize) h < (gsize) (handle_slab + handle_slab_used) &&
+	        ((gsize) h - (gsize) handle_slab) % sizeof (PspiHandle) == 0);
+}
+
 static gboolean
 handle_valid (Handle h)
 {
+	if (in_handle_slab ((PspiHandle *) h))
+		return ((PspiHandle *) h)->magic == PSPI_HANDLE_MAGIC;
+
 	return handles != NULL && g_hash_table_lookup (handles, h) != NULL;
 }
 
+static PspiHandle *
+handle_alloc (void)
+{
+	PspiHandle *result;
+
+	if (free_handles != NULL)
+		{
+			result = free_handles;
+			free_handles = result->pointer;
+		}
+	else
+		{
+			if (handle_slab == NULL)
+				handle_slab = g_new (PspiHandle, HANDLE_SLAB_SIZE);
+
+			if (handle_slab_used < HANDLE_SLAB_SIZE)
+				result = handle_slab + handle_slab_used++;
+			else
+				{
+					result = g_new (PspiHandle, 1);
+					if (handles == NULL)
+						handles = g_hash_table_new (NULL, NULL);
+					g_hash_table_insert (handles, result, result);
+				}
+		}
+	result->magic = PSPI_HANDLE_MAGIC;
+	result->owner = alloc_owner;
+
+	return result;
+}
+
+static void
+handle_free (PspiHandle *h)
+{
+	h->magic = 0;
+	if (in_handle_slab (h))
+		{
+			h->pointer = free_handles;
+			free_handles = h;
+		}
+	else
+		{
+			g_hash_table_remove (handles, h);
+			g_free (h);
+		}
+}
+
+/* What a handle not from us is. Probing is expensive, and some
+ * plug-ins lock and unlock their handles all the time, so remember.
+ */
+static gint
+foreign_kind (Handle h)
+{
+	gint kind;
+
+	if (foreign_handles == NULL)
+		foreign_handles = g_hash_table_new (NULL, NULL);
+	else if ((kind = GPOINTER_TO_INT (g_hash_table_lookup (foreign_handles, h))) != FOREIGN_INVALID)
+		return kind;
+
+	if (GlobalSize ((HGLOBAL) h) > 0)
+		kind = FOREIGN_HGLOBAL;
+	else if (!IsBadReadPtr (h, sizeof (HGLOBAL *)) &&
+	         GlobalSize (*(HGLOBAL *) h) > 0)
+		kind = FOREIGN_HGLOBAL_PTR;
+	else
+		return FOREIGN_INVALID;
+
+	g_hash_table_insert (foreign_handles, h, GINT_TO_POINTER (kind));
+
+	return kind;
+}
+
+static void
+foreign_forget (Handle h)
+{
+	if (foreign_handles != NULL)
+		g_hash_table_remove (foreign_handles, h);
+}
+
+/* Handle contents. Plug-ins often grow handles a bit at a time, so
+ * grow the allocation geometrically. Where there is mremap(), large
+ * handles are mapped and grow without copying.
+ */
+static void
+handle_data_resize (PspiHandle *h,
+                    guint       size)
+{
+	guint capacity;
+
+	if (size <= h->capacity)
+		return;
+
+	capacity = MAX (size, h->capacity + h->capacity / 2);
+	memory_free (PSPI_MEMORY_HANDLES, h->capacity);
+
+#ifdef MREMAP_MAYMOVE
+	if (capacity >= HANDLE_MMAP_THRESHOLD)
+		{
+			const guint page = sysconf (_SC_PAGESIZE);
+			gpointer p;
+
+			capacity = (capacity + page - 1) / page * page;
+			if (h->mapped)
+				p = mremap (h->pointer, h->capacity, capacity, MREMAP_MAYMOVE);
+			else
+				{
+					p = mmap (NULL, capacity, PROT_READ | PROT_WRITE,
+					          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+					if (p != MAP_FAILED && h->pointer != NULL)
+						{
+							memcpy (p, h->pointer, h->size);
+							g_free (h->pointer);
+						}
+				}
+			if (p != MAP_FAILED)
+				{
+					h->pointer = p;
+					h->capacity = capacity;
+					h->mapped = TRUE;
+					memory_alloc (PSPI_MEMORY_HANDLES, capacity);
+					return;
+				}
+			if (h->mapped)
+				{
+					/* Can't get a bigger mapping, get it copied */
+					p = g_malloc (capacity);
+					memcpy (p, h->pointer, h->size);
+					munmap (h->pointer, h->capacity);
+					h->pointer = p;
+					h->capacity = capacity;
+					h->mapped = FALSE;
+					memory_alloc (PSPI_MEMORY_HANDLES, capacity);
+					return;
+				}
+		}
+#endif
+
+	h->pointer = g_realloc (h->pointer, capacity);
+	h->capacity = capacity;
+	memory_alloc (PSPI_MEMORY_HANDLES, capacity);
+}
+
+static void
+handle_data_free (PspiHandle *h)
+{
+	memory_free (PSPI_MEMORY_HANDLES, h->capacity);
+#ifdef MREMAP_MAYMOVE
+	if (h->mapped)
+		munmap (h->pointer, h->capacity);
+	else
+#endif
+		g_free (h->pointer);
+}
+
 static Handle
 handle_new_proc (int32 size)
 {
-	PspiHandle *result = g_new (PspiHandle, 1);
-	result->pointer = g_malloc (size);
+	PspiHandle *result = handle_alloc ();
+	result->pointer = NULL;
+	result->capacity = 0;
+	result->mapped = FALSE;
+	handle_data_resize (result, size);
 	result->size = size;
 	PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %ld: %p, %p\n",
 	                                   __FUNCTION__,
 	                                   size, result, result->pointer));
-	if (handles == NULL)
-		handles = g_hash_table_new (NULL, NULL);
-
-	g_hash_table_insert (handles, result, result->pointer);
 
 	return (Handle) result;
 }
@@ -383,17 +888,20 @@ handle_dispose_proc (Handle h)
 {
 	if (!handle_valid (h))
 		{
-			if (GlobalSize ((HGLOBAL) h) > 0)
+			const gint kind = foreign_kind (h);
+
+			if (kind == FOREIGN_HGLOBAL)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL!\n", __FUNCTION__, h));
 					GlobalFree ((HGLOBAL) h);
+					foreign_forget (h);
 					return;
 				}
-			else if (!IsBadReadPtr (h, sizeof (HGLOBAL *)) &&
-			         GlobalSize (*(HGLOBAL *) h) > 0)
+			else if (kind == FOREIGN_HGLOBAL_PTR)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL*!\n", __FUNCTION__, h));
 					GlobalFree (*(HGLOBAL *) h);
+					foreign_forget (h);
 					return;
 				}
 			else
@@ -406,9 +914,8 @@ handle_dispose_proc (Handle h)
 	PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p, %p\n",
 	                                   __FUNCTION__,
 	                                   h, ((PspiHandle *)h)->pointer));
-	g_free (((PspiHandle *) h)->pointer);
-	g_free ((PspiHandle *) h);
-	g_hash_table_remove (handles, h);
+	handle_data_free ((PspiHandle *) h);
+	handle_free ((PspiHandle *) h);
 }
 
 static int32
@@ -418,14 +925,17 @@ handle_get_size_proc (Handle h)
 
 	if (!handle_valid (h))
 		{
-			if ((size = GlobalSize ((HGLOBAL) h)) > 0)
+			const gint kind = foreign_kind (h);
+
+			if (kind == FOREIGN_HGLOBAL &&
+			        (size = GlobalSize ((HGLOBAL) h)) > 0)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL!: %d\n",
 					                                   __FUNCTION__,
 					                                   h, size));
 					return size;
 				}
-			else if (!IsBadReadPtr (h, sizeof (HGLOBAL *)) &&
+			else if (kind == FOREIGN_HGLOBAL_PTR &&
 			         (size = GlobalSize (*(HGLOBAL *) h)) > 0)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL*!: %d\n",
@@ -452,7 +962,9 @@ handle_set_size_proc (Handle h,
 {
 	if (!handle_valid (h))
 		{
-			if (GlobalSize ((HGLOBAL) h) > 0)
+			const gint kind = foreign_kind (h);
+
+			if (kind == FOREIGN_HGLOBAL)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL!, %ld\n",
 					                                   __FUNCTION__, h, newSize));
@@ -460,8 +972,7 @@ handle_set_size_proc (Handle h,
 						return nilHandleErr;
 					return noErr;
 				}
-			else if (!IsBadReadPtr (h, sizeof (HGLOBAL *)) &&
-			         GlobalSize (*(HGLOBAL *) h) > 0)
+			else if (kind == FOREIGN_HGLOBAL_PTR)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL*!\n", __FUNCTION__, h));
 					*((HGLOBAL *) h) = GlobalReAlloc (*(HGLOBAL *) h, newSize, 0);
@@ -475,7 +986,7 @@ handle_set_size_proc (Handle h,
 				}
 		}
 
-	((PspiHandle *) h)->pointer = g_realloc (((PspiHandle *) h)->pointer, newSize);
+	handle_data_resize ((PspiHandle *) h, newSize);
 	((PspiHandle *) h)->size = newSize;
 	PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p, %ld: %p\n",
 	                                   __FUNCTION__,
@@ -489,13 +1000,14 @@ handle_lock_proc (Handle  h,
 {
 	if (!handle_valid (h))
 		{
-			if (GlobalSize ((HGLOBAL) h) > 0)
+			const gint kind = foreign_kind (h);
+
+			if (kind == FOREIGN_HGLOBAL)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL!\n", __FUNCTION__, h));
 					return GlobalLock ((HGLOBAL) h);
 				}
-			else if (!IsBadReadPtr (h, sizeof (HGLOBAL *)) &&
-			         GlobalSize (*(HGLOBAL *) h) > 0)
+			else if (kind == FOREIGN_HGLOBAL_PTR)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL*!\n", __FUNCTION__, h));
 					return GlobalLock (*(HGLOBAL *) h);
@@ -526,14 +1038,15 @@ handle_unlock_proc (Handle h)
 {
 	if (!handle_valid (h))
 		{
-			if (GlobalSize ((HGLOBAL) h) > 0)
+			const gint kind = foreign_kind (h);
+
+			if (kind == FOREIGN_HGLOBAL)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL!\n", __FUNCTION__, h));
 					GlobalUnlock ((HGLOBAL) h);
 					return;
 				}
-			else if (!IsBadReadPtr (h, sizeof (HGLOBAL *)) &&
-			         GlobalSize (*(HGLOBAL *) h) > 0)
+			else if (kind == FOREIGN_HGLOBAL_PTR)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL*!\n", __FUNCTION__, h));
 					GlobalUnlock (*(HGLOBAL *) h);
@@ -563,17 +1076,20 @@ handle_dispose_regular_proc (Handle h)
 
 	if (!handle_valid (h))
 		{
-			if (GlobalSize ((HGLOBAL) h) > 0)
+			const gint kind = foreign_kind (h);
+
+			if (kind == FOREIGN_HGLOBAL)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL!\n", __FUNCTION__, h));
 					GlobalFree ((HGLOBAL) h);
+					foreign_forget (h);
 					return;
 				}
-			else if (!IsBadReadPtr (h, sizeof (HGLOBAL *)) &&
-			         GlobalSize (*(HGLOBAL *) h) > 0)
+			else if (kind == FOREIGN_HGLOBAL_PTR)
 				{
 					PSPI_DEBUG (HANDLE_SUITE, g_print (G_STRLOC ":%s: %p is HGLOBAL*!\n", __FUNCTION__, h));
 					GlobalFree (*(HGLOBAL *) h);
+					foreign_forget (h);
 					return;
 				}
 			else
@@ -634,6 +1150,60 @@ image_services_interpolate_2d_multi_proc (PSImageMultiPlane *source,
 	return memFullErr;
 }
 
+static void
+image_props_clear (void)
+{
+	gint i;
+
+	for (i = 0; i < image_props.num_channels; i++)
+		g_free (image_props.channel_names[i]);
+	g_free (image_props.channel_names);
+	for (i = 0; i < image_props.num_paths; i++)
+		g_free (image_props.path_names[i]);
+	g_free (image_props.path_names);
+	memset (&image_props, 0, sizeof (image_props));
+	image_props.image = -1;
+}
+
+static void
+image_props_snapshot (void)
+{
+	gint32 *channels;
+	gint i;
+
+	image_props_clear ();
+	image_props.image = image_id;
+
+	channels = gimp_image_get_channels (image_id, &image_props.num_channels);
+	image_props.channel_names = g_new (gchar *, image_props.num_channels);
+	for (i = 0; i < image_props.num_channels; i++)
+		image_props.channel_names[i] = gimp_drawable_get_name (channels[i]);
+	g_free (channels);
+
+	image_props.path_names = gimp_path_list (image_id, &image_props.num_paths);
+
+	image_props.width = gimp_image_width (image_id);
+	image_props.height = gimp_image_height (image_id);
+	gimp_image_get_resolution (image_id, &image_props.xres, &image_props.yres);
+
+	PSPI_DEBUG (PROPERTY_SUITE, g_print (G_STRLOC ":%s: %d channels, %d paths\n",
+	                                     __FUNCTION__,
+	                                     image_props.num_channels,
+	                                     image_props.num_paths));
+}
+
+static Handle
+string_handle (const gchar *s)
+{
+	Handle h = handle_new_proc (strlen (s));
+	gpointer p = handle_lock_proc (h, TRUE);
+
+	memcpy (p, s, strlen (s));
+	handle_unlock_proc (h);
+
+	return h;
+}
+
 static OSErr
 property_get_proc (PIType  signature,
                    PIType  key,
@@ -649,32 +1219,19 @@ property_get_proc (PIType  signature,
 	if (signature != kPhotoshopSignature)
 		return errPlugInHostInsufficient;
 
+	/* Plug-ins may ask already in filterSelectorParameters */
+	if (image_props.image != image_id)
+		image_props_snapshot ();
+
 	if (key == MULTIC (propNumberOfChannels))
 		{
-			gint num_channels;
-			gint32 *channels = gimp_image_get_channels (image_id, &num_channels);
-			g_free (channels);
-			*simpleProperty = num_channels;
+			*simpleProperty = image_props.num_channels;
 		}
 	else if (key == MULTIC (propChannelName))
 		{
-			gint num_channels;
-			gint32 *channels = gimp_image_get_channels (image_id, &num_channels);
-			gchar *channel_name;
-			gpointer p;
-
-			if (index < 0 || index >= num_channels)
-				{
-					g_free (channels);
-					return errPlugInPropertyUndefined;
-				}
-			channel_name = gimp_drawable_get_name (channels[index]);
-			g_free (channels);
-			*complexProperty = handle_new_proc (strlen (channel_name));
-			p = handle_lock_proc (*complexProperty, TRUE);
-			memcpy (p, channel_name, strlen (channel_name));
-			handle_unlock_proc (*complexProperty);
-			g_free (channel_name);
+			if (index < 0 || index >= image_props.num_channels)
+				return errPlugInPropertyUndefined;
+			*complexProperty = string_handle (image_props.channel_names[index]);
 		}
 	else if (key == MULTIC (propImageMode))
 		{
@@ -682,36 +1239,21 @@ property_get_proc (PIType  signature,
 		}
 	else if (key == MULTIC (propNumberOfPaths))
 		{
-			int i;
-			gint num_paths;
-			gchar **paths = gimp_path_list (image_id, &num_paths);
-
-			for (i = 0; i < num_paths; i++)
-				g_free (paths[i]);
-			g_free (paths);
-			*simpleProperty = num_paths;
+			*simpleProperty = image_props.num_paths;
 		}
 	else if (key == MULTIC (propPathName))
 		{
-			int i;
-			gint num_paths;
-			gchar **paths = gimp_path_list (image_id, &num_paths);
-			gpointer p;
-
-			if (index < 0 || index >= num_paths)
-				{
-					for (i = 0; i < num_paths; i++)
-						g_free (paths[i]);
-					g_free (paths);
-					return errPlugInPropertyUndefined;
-				}
-			*complexProperty = handle_new_proc (strlen (paths[index]));
-			p = handle_lock_proc (*complexProperty, TRUE);
-			memcpy (p, paths[index], strlen (paths[index]));
-			handle_unlock_proc (*complexProperty);
-			for (i = 0; i < num_paths; i++)
-				g_free (paths[i]);
-			g_free (paths);
+			if (index < 0 || index >= image_props.num_paths)
+				return errPlugInPropertyUndefined;
+			*complexProperty = string_handle (image_props.path_names[index]);
+		}
+	else if (key == MULTIC (propDocumentWidth))
+		{
+			*simpleProperty = image_props.width;
+		}
+	else if (key == MULTIC (propDocumentHeight))
+		{
+			*simpleProperty = image_props.height;
 		}
 	else
 		return errPlugInHostInsufficient;
@@ -752,27 +1294,249 @@ property_set_proc (PIType signature,
 	return noErr;
 }
 
-static int16
-resource_count_proc (ResType ofType)
+static void
+resource_free (gpointer p)
 {
-	GimpParasite *parasite;
-	gchar token[20];
-	gint i;
+	g_byte_array_free (p, TRUE);
+}
 
-	i = 0;
-	while (TRUE)
+static void
+resource_list_free (gpointer p)
+{
+	g_ptr_array_free (p, TRUE);
+}
+
+static GPtrArray *
+resource_list (ResType  type,
+               gboolean create)
+{
+	GPtrArray *list = g_hash_table_lookup (resources, GUINT_TO_POINTER (type));
+
+	if (list == NULL && create)
 		{
-			sprintf (token, "pspi-res-%s-%d", int32_as_be_4c (ofType), i);
-			parasite = gimp_image_parasite_find (image_id, token);
-			if (parasite == NULL)
-				break;
-			gimp_parasite_free (parasite);
-			i++;
+			list = g_ptr_array_new_with_free_func (resource_free);
+			g_hash_table_insert (resources, GUINT_TO_POINTER (type), list);
 		}
 
-	PSPI_DEBUG (RESOURCE_SUITE, g_print (G_STRLOC ":%s: %s: %d\n",
-	                                     __FUNCTION__,
-	                                     int32_as_be_4c (ofType), i));
+	return list;
+}
+
+static void
+resource_append (ResType       type,
+                 gconstpointer data,
+                 guint         size)
+{
+	GByteArray *res = g_byte_array_sized_new (size);
+
+	g_byte_array_append (res, data, size);
+	g_ptr_array_add (resource_list (type, TRUE), res);
+}
+
+static gboolean
+resources_parse (const guchar *p,
+                 gsize         size)
+{
+	const guchar *end = p + size;
+	guint32 version;
+
+	if (size < 8 || memcmp (p, RESOURCES_MAGIC, 4) != 0)
+		return FALSE;
+
+	memcpy (&version, p + 4, 4);
+	version = GUINT32_FROM_BE (version);
+	if (version > RESOURCES_VERSION)
+		return FALSE;
+
+	p += 8;
+	while (end - p >= 8)
+		{
+			guint32 type, len;
+
+			memcpy (&type, p, 4);
+			memcpy (&len, p + 4, 4);
+			type = GUINT32_FROM_BE (type);
+			len = GUINT32_FROM_BE (len);
+			p += 8;
+			if (len > end - p)
+				return FALSE;
+			resource_append (type, p, len);
+			p += len;
+		}
+
+	return TRUE;
+}
+
+/* Resources used to be stored one parasite each, as
+ * pspi-res-TYPE-N. Pick those up; they are removed when the store
+ * is written back.
+ */
+static void
+resources_load_legacy (void)
+{
+	GimpParasite *parasite;
+	gchar **names;
+	gchar token[20];
+	gint num_names, i, n;
+
+	if (!gimp_image_parasite_list (image_id, &num_names, &names))
+		return;
+
+	for (i = 0; i < num_names; i++)
+		{
+			const guchar *t = (const guchar *) names[i] + 9;
+			ResType type;
+
+			if (!g_str_has_prefix (names[i], "pspi-res-") ||
+			    strlen (names[i]) != 15 ||
+			    strcmp (names[i] + 13, "-0") != 0)
+				continue;
+
+			type = (t[0] << 24) | (t[1] << 16) | (t[2] << 8) | t[3];
+			for (n = 0; ; n++)
+				{
+					sprintf (token, "pspi-res-%.4s-%d", t, n);
+					parasite = gimp_image_parasite_find (image_id, token);
+					if (parasite == NULL)
+						break;
+					resource_append (type, parasite->data, parasite->size);
+					resources_legacy = g_slist_prepend (resources_legacy, g_strdup (token));
+					gimp_parasite_free (parasite);
+				}
+		}
+
+	for (i = 0; i < num_names; i++)
+		g_free (names[i]);
+	g_free (names);
+}
+
+static void
+resources_discard (void)
+{
+	if (resources != NULL)
+		g_hash_table_destroy (resources);
+	resources = NULL;
+	resources_readonly = FALSE;
+	g_slist_foreach (resources_legacy, (GFunc) g_free, NULL);
+	g_slist_free (resources_legacy);
+	resources_legacy = NULL;
+	resources_dirty = FALSE;
+}
+
+static void
+resources_load (void)
+{
+	GimpParasite *parasite;
+
+	if (resources != NULL && resources_image == image_id)
+		return;
+
+	resources_discard ();
+	resources = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+	                                   NULL, resource_list_free);
+	resources_image = image_id;
+
+	parasite = gimp_image_parasite_find (image_id, RESOURCES_PARASITE);
+	if (parasite != NULL)
+		{
+			if (!resources_parse (parasite->data, parasite->size))
+				{
+					/* Don't overwrite what we can't read */
+					g_message (_("pspi: Unrecognized %s parasite, "
+					             "resources will not be saved"),
+					           RESOURCES_PARASITE);
+					resources_readonly = TRUE;
+				}
+			gimp_parasite_free (parasite);
+		}
+
+	resources_load_legacy ();
+	if (resources_legacy != NULL)
+		resources_dirty = TRUE;
+
+	PSPI_DEBUG (RESOURCE_SUITE, g_print (G_STRLOC ":%s: %d types, %d legacy\n",
+	                                     __FUNCTION__,
+	                                     g_hash_table_size (resources),
+	                                     g_slist_length (resources_legacy)));
+}
+
+static void
+resources_serialize (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
+{
+	GPtrArray *list = value;
+	GByteArray *out = user_data;
+	guint i;
+
+	for (i = 0; i < list->len; i++)
+		{
+			GByteArray *res = g_ptr_array_index (list, i);
+			guint32 header[2];
+
+			header[0] = GUINT32_TO_BE (GPOINTER_TO_UINT (key));
+			header[1] = GUINT32_TO_BE (res->len);
+			g_byte_array_append (out, (guint8 *) header, sizeof (header));
+			g_byte_array_append (out, res->data, res->len);
+		}
+}
+
+/* Write the store back to the image, if the plug-in changed it */
+static void
+resources_flush (void)
+{
+	GByteArray *out;
+	guint32 version;
+	GSList *l;
+
+	if (resources == NULL || !resources_dirty)
+		return;
+
+	if (resources_readonly || resources_image != image_id)
+		{
+			resources_discard ();
+			return;
+		}
+
+	out = g_byte_array_new ();
+	g_byte_array_append (out, (guint8 *) RESOURCES_MAGIC, 4);
+	version = GUINT32_TO_BE (RESOURCES_VERSION);
+	g_byte_array_append (out, (guint8 *) &version, 4);
+	g_hash_table_foreach (resources, resources_serialize, out);
+
+	if (out->len > 8)
+		gimp_image_attach_new_parasite (image_id, RESOURCES_PARASITE,
+		                                GIMP_PARASITE_PERSISTENT,
+		                                out->len, out->data);
+	else
+		gimp_image_parasite_detach (image_id, RESOURCES_PARASITE);
+
+	for (l = resources_legacy; l != NULL; l = l->next)
+		gimp_image_parasite_detach (image_id, l->data);
+
+	PSPI_DEBUG (RESOURCE_SUITE, g_print (G_STRLOC ":%s: %u bytes, %d legacy removed\n",
+	                                     __FUNCTION__, out->len,
+	                                     g_slist_length (resources_legacy)));
+
+	g_byte_array_free (out, TRUE);
+	g_slist_foreach (resources_legacy, (GFunc) g_free, NULL);
+	g_slist_free (resources_legacy);
+	resources_legacy = NULL;
+	resources_dirty = FALSE;
+}
+
+static int16
+resource_count_proc (ResType ofType)
+{
+	GPtrArray *list;
+	gint i;
+
+	resources_load ();
+	list = resource_list (ofType, FALSE);
+	i = (list != NULL ? list->len : 0);
+
+	PSPI_DEBUG (RESOURCE_SUITE, g_print (G_STRLOC ":%s: %s: %d\n",
+	                                     __FUNCTION__,
+	                                     int32_as_be_4c (ofType), i));
 	return i;
 }
 
@@ -780,15 +1544,15 @@ static Handle
 resource_get_proc (ResType ofType,
                    int16   index)
 {
-	GimpParasite *parasite;
-	gchar token[20];
+	GPtrArray *list;
+	GByteArray *res;
 	Handle result;
 	gpointer p;
 
-	sprintf (token, "pspi-res-%s-%d", int32_as_be_4c (ofType), index);
-	parasite = gimp_image_parasite_find (image_id, token);
+	resources_load ();
+	list = resource_list (ofType, FALSE);
 
-	if (parasite == NULL)
+	if (list == NULL || index < 0 || index >= list->len)
 		{
 			PSPI_DEBUG (RESOURCE_SUITE, g_print (G_STRLOC ":%s: %s, %d: 0\n",
 			                                     __FUNCTION__,
@@ -796,11 +1560,11 @@ resource_get_proc (ResType ofType,
 			return (Handle) 0;
 		}
 
-	result = handle_new_proc (parasite->size);
+	res = g_ptr_array_index (list, index);
+	result = handle_new_proc (res->len);
 	p = handle_lock_proc (result, FALSE);
-	memmove (p, parasite->data, parasite->size);
+	memmove (p, res->data, res->len);
 	handle_unlock_proc (result);
-	gimp_parasite_free (parasite);
 
 	PSPI_DEBUG (RESOURCE_SUITE, g_print (G_STRLOC ":%s: %s, %d: %p\n",
 	                                     __FUNCTION__,
@@ -812,39 +1576,25 @@ static void
 resource_delete_proc (ResType ofType,
                       int16   index)
 {
-	GimpParasite *parasite;
-	gchar token[20];
-	gint i;
+	GPtrArray *list;
 
 	PSPI_DEBUG (RESOURCE_SUITE, g_print (G_STRLOC ":%s: %s, %d\n",
 	                                     __FUNCTION__,
 	                                     int32_as_be_4c (ofType), index));
 
-	sprintf (token, "pspi-res-%s-%d", int32_as_be_4c (ofType), index);
-	gimp_image_parasite_detach (image_id, token);
+	resources_load ();
+	list = resource_list (ofType, FALSE);
+	if (list == NULL || index < 0 || index >= list->len)
+		return;
 
-	i = index + 1;
-	while (TRUE)
-		{
-			gchar token2[20];
-			sprintf (token, "pspi-res-%s-%d", int32_as_be_4c (ofType), i);
-			parasite = gimp_image_parasite_find (image_id, token);
-			if (parasite == NULL)
-				break;
-			sprintf (token2, "pspi-res-%s-%d", int32_as_be_4c (ofType), i - 1);
-			gimp_image_attach_new_parasite (image_id, token2, parasite->flags, parasite->size, parasite->data);
-			gimp_image_parasite_detach (image_id, token);
-			gimp_parasite_free (parasite);
-			i++;
-		}
+	g_ptr_array_remove_index (list, index);
+	resources_dirty = TRUE;
 }
 
 static OSErr
 resource_add_proc (ResType ofType,
                    Handle  data)
 {
-	gchar token[20];
-	gint i;
 	gpointer p;
 	gint size;
 
@@ -852,14 +1602,12 @@ resource_add_proc (ResType ofType,
 	                                     __FUNCTION__,
 	                                     int32_as_be_4c (ofType), data));
 
-	i = resource_count_proc (ofType);
-	sprintf (token, "pspi-res-%s-%d", int32_as_be_4c (ofType), i);
+	resources_load ();
 	size = handle_get_size_proc (data);
 	p = handle_lock_proc (data, FALSE);
-
-	gimp_image_attach_new_parasite (image_id, token, GIMP_PARASITE_PERSISTENT,
-	                                size, p);
+	resource_append (ofType, p, size);
 	handle_unlock_proc (data);
+	resources_dirty = TRUE;
 
 	return noErr;
 }
@@ -892,15 +1640,44 @@ color_services_proc (ColorServicesInfo *info)
 	return errPlugInHostInsufficient;
 }
 
+static void
+register_suite (const char *name,
+                int32       version,
+                const void *suite)
+{
+	PspiSuite *s = g_new (PspiSuite, 1);
+	const gchar *key = g_intern_string (name);
+
+	s->version = version;
+	s->suite = suite;
+
+	if (suites == NULL)
+		suites = g_hash_table_new (NULL, NULL);
+	g_hash_table_insert (suites, (gpointer) key,
+	                     g_slist_prepend (g_hash_table_lookup (suites, key), s));
+}
+
 SPAPI SPErr
 SPBasicAcquireSuite (const char  *name,
                      int32   version,
                      const void **suite)
 {
+	GSList *list = NULL;
+
 	PSPI_DEBUG (SPBASIC_SUITE, g_print (G_STRLOC ":%s: %s %ld\n",
 	                                    __FUNCTION__,
 	                                    name, version));
 
+	if (suites != NULL && name != NULL)
+		list = g_hash_table_lookup (suites, g_intern_string (name));
+
+	for (; list != NULL; list = list->next)
+		if (((PspiSuite *) list->data)->version == version)
+			{
+				*suite = ((PspiSuite *) list->data)->suite;
+				return kSPNoError;
+			}
+
 	return errPlugInHostInsufficient;
 }
 
@@ -923,15 +1700,27 @@ SPBasicIsEqual (const char *token1,
 	                                    __FUNCTION__,
 	                                    token1, token2));
 
-	return 0;
+	if (token1 == NULL || token2 == NULL)
+		return token1 == token2;
+
+	return strcmp (token1, token2) == 0;
 }
 
 SPAPI SPErr
 SPBasicAllocateBlock (size_t   size,
                       void **block )
 {
+	PspiBlock *b = g_new (PspiBlock, 1);
+
 	*block = g_malloc (size);
 
+	if (blocks == NULL)
+		blocks = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+	b->size = size;
+	b->owner = alloc_owner;
+	g_hash_table_insert (blocks, *block, b);
+	memory_alloc (PSPI_MEMORY_BLOCKS, size);
+
 	PSPI_DEBUG (SPBASIC_SUITE, g_print (G_STRLOC ":%s: %ld: %p\n",
 	                                    __FUNCTION__,
 	                                    size, *block));
@@ -942,10 +1731,17 @@ SPBasicAllocateBlock (size_t   size,
 SPAPI SPErr
 SPBasicFreeBlock (void *block)
 {
+	PspiBlock *b;
+
 	PSPI_DEBUG (SPBASIC_SUITE, g_print (G_STRLOC ":%s: %p\n",
 	                                    __FUNCTION__,
 	                                    block));
 
+	if (blocks != NULL && (b = g_hash_table_lookup (blocks, block)) != NULL)
+		{
+			memory_free (PSPI_MEMORY_BLOCKS, b->size);
+			g_hash_table_remove (blocks, block);
+		}
 	g_free (block);
 
 	return 0;
@@ -956,8 +1752,26 @@ SPBasicReallocateBlock (void  *block,
                         size_t   newSize,
                         void **newblock)
 {
+	PspiBlock *b = NULL;
+
 	*newblock = g_realloc (block, newSize);
 
+	if (blocks == NULL)
+		blocks = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+	if (block != NULL && (b = g_hash_table_lookup (blocks, block)) != NULL)
+		{
+			memory_free (PSPI_MEMORY_BLOCKS, b->size);
+			g_hash_table_steal (blocks, block);
+		}
+	else
+		{
+			b = g_new (PspiBlock, 1);
+			b->owner = alloc_owner;
+		}
+	b->size = newSize;
+	g_hash_table_insert (blocks, *newblock, b);
+	memory_alloc (PSPI_MEMORY_BLOCKS, newSize);
+
 	PSPI_DEBUG (SPBASIC_SUITE, g_print (G_STRLOC ":%s: %p, %ld: %p\n",
 	                                    __FUNCTION__,
 	                                    block, newSize, *newblock));
@@ -973,17 +1787,333 @@ SPBasicUndefined (void)
 	return 0;
 }
 
+/* Set from the watchdog thread when the filter should stop. Some
+ * plug-ins call abortProc for every pixel, so it only reads this.
+ */
+static volatile gint abort_requested = FALSE;
+
+static GMutex watchdog_mutex;
+static GCond watchdog_cond;
+static GThread *watchdog_thread = NULL;
+static gint64 watchdog_deadline;	/* Monotonic time, or 0 */
+
+/* The selector call being watched, see selector_watch() */
+static gint selector_limit;		/* Seconds, or 0 */
+static const PSPlugInEntry *selector_entry;
+static const gchar *selector_name;
+static gint64 selector_deadline, kill_deadline;
+
 static Boolean
 abort_proc ()
 {
-	return FALSE;
+	return g_atomic_int_get (&abort_requested);
+}
+
+/* The plug-in has not come back from a selector even after being
+ * asked to abort. There is no way to get the thread out of the DLL,
+ * so give up on the whole process. Called with watchdog_mutex held.
+ */
+static void
+watchdog_terminate (void)
+{
+	gchar *msg = g_strdup_printf (_("pspi: %s did not return from %s in %d seconds and was terminated"),
+	                              strrchr (selector_entry->menu_path, '/') + 1,
+	                              selector_name, selector_limit);
+
+	/* The filter thread may be in the middle of talking to the GIMP
+	 * core, so nothing can be sent over the wire from here. GIMP only
+	 * sees the plug-in crash.
+	 */
+	g_printerr ("%s\n", msg);
+	g_free (msg);
+
+	history_record_timeout (selector_entry->pdb_name, selector_name,
+	                        selector_limit);
+	_exit (1);
+}
+
+static gint64
+next_deadline (void)
+{
+	gint64 next = 0;
+
+	if (watchdog_deadline != 0)
+		next = watchdog_deadline;
+	if (selector_deadline != 0 && (next == 0 || selector_deadline < next))
+		next = selector_deadline;
+	if (kill_deadline != 0 && (next == 0 || kill_deadline < next))
+		next = kill_deadline;
+
+	return next;
+}
+
+static gpointer
+watchdog (gpointer data)
+{
+	g_mutex_lock (&watchdog_mutex);
+	while (TRUE)
+		{
+			gint64 next = next_deadline (), now;
+
+			if (next == 0)
+				g_cond_wait (&watchdog_cond, &watchdog_mutex);
+			else
+				g_cond_wait_until (&watchdog_cond, &watchdog_mutex, next);
+
+			now = g_get_monotonic_time ();
+			if (watchdog_deadline != 0 && now >= watchdog_deadline)
+				{
+					g_atomic_int_set (&abort_requested, TRUE);
+					watchdog_deadline = 0;
+				}
+			if (selector_deadline != 0 && now >= selector_deadline)
+				{
+					/* Ask nicely first */
+					g_atomic_int_set (&abort_requested, TRUE);
+					selector_deadline = 0;
+					kill_deadline = now + SELECTOR_GRACE_TIME * G_USEC_PER_SEC;
+				}
+			if (kill_deadline != 0 && now >= kill_deadline)
+				watchdog_terminate ();
+		}
+	g_mutex_unlock (&watchdog_mutex);
+
+	return NULL;
+}
+
+/* Called with watchdog_mutex held */
+static void
+watchdog_start (void)
+{
+	if (watchdog_thread == NULL)
+		watchdog_thread = g_thread_new ("pspi-watchdog", watchdog, NULL);
+}
+
+/* Have abort_proc() return TRUE after usecs microseconds */
+static void
+watchdog_arm (gint64 usecs)
+{
+	g_atomic_int_set (&abort_requested, FALSE);
+	if (usecs <= 0)
+		return;
+
+	g_mutex_lock (&watchdog_mutex);
+	watchdog_start ();
+	watchdog_deadline = g_get_monotonic_time () + usecs;
+	g_cond_signal (&watchdog_cond);
+	g_mutex_unlock (&watchdog_mutex);
+}
+
+static void
+watchdog_disarm (void)
+{
+	if (watchdog_thread == NULL)
+		return;
+
+	g_mutex_lock (&watchdog_mutex);
+	watchdog_deadline = 0;
+	g_cond_signal (&watchdog_cond);
+	g_mutex_unlock (&watchdog_mutex);
+}
+
+/* Limit the time until selector_done(): after selector_limit seconds
+ * ask the plug-in to abort, and if that doesn't help, terminate.
+ */
+static void
+selector_watch (const PSPlugInEntry *pspie,
+                const gchar         *name)
+{
+	if (selector_limit <= 0)
+		return;
+
+	g_mutex_lock (&watchdog_mutex);
+	watchdog_start ();
+	selector_entry = pspie;
+	selector_name = name;
+	selector_deadline = g_get_monotonic_time () + (gint64) selector_limit * G_USEC_PER_SEC;
+	kill_deadline = 0;
+	g_cond_signal (&watchdog_cond);
+	g_mutex_unlock (&watchdog_mutex);
+}
+
+static void
+selector_done (void)
+{
+	if (selector_limit <= 0)
+		return;
+
+	g_mutex_lock (&watchdog_mutex);
+	selector_deadline = kill_deadline = 0;
+	g_mutex_unlock (&watchdog_mutex);
+}
+
+/* Seconds a single selector call may take: from pspirc for the
+ * plug-in, otherwise from gimprc. 0 if unlimited.
+ */
+static gint
+selector_time_limit (const PSPlugInEntry *pspie)
+{
+	gchar *value;
+	gint retval = 0;
+
+	if (pspie->time_limit > 0)
+		return pspie->time_limit;
+
+	if ((value = gimp_gimprc_query (PSPI_SELECTOR_TIME_LIMIT_TOKEN)) != NULL)
+		{
+			retval = MAX (atoi (value), 0);
+			g_free (value);
+		}
+
+	return retval;
+}
+
+/* Seconds the whole filter run may take, from gimprc. 0 if unlimited. */
+static gint
+time_limit (void)
+{
+	gchar *value = gimp_gimprc_query (PSPI_TIME_LIMIT_TOKEN);
+	gint retval = 0;
+
+	if (value != NULL)
+		{
+			retval = MAX (atoi (value), 0);
+			g_free (value);
+		}
+
+	return retval;
+}
+
+/* Statistics of the current run, for progress and the history */
+static GTimer *run_timer = NULL;
+static gint64 host_usecs;	/* Spent in advance_state_proc() */
+static guint64 bytes_in, bytes_out;
+static gdouble expected_time;	/* From earlier runs, or negative */
+static gdouble plugin_progress;
+static gchar *progress_label = NULL;
+static gint eta_shown;
+static gint64 progress_interval;	/* Microseconds between updates */
+static gint64 progress_shown_time;
+static gdouble progress_shown;
+
+static void
+start_run (const PSPlugInEntry *pspie)
+{
+	if (run_timer == NULL)
+		run_timer = g_timer_new ();
+	g_timer_start (run_timer);
+	host_usecs = 0;
+	bytes_in = bytes_out = 0;
+	plugin_progress = 0;
+	eta_shown = -1;
+	progress_shown_time = 0;
+	progress_shown = 0;
+
+	/* Each update is a round trip to the GIMP core, and some plug-ins
+	 * report progress for every row.
+	 */
+	{
+		gchar *value = gimp_gimprc_query (PSPI_PROGRESS_RATE_TOKEN);
+		gint rate = DEFAULT_PROGRESS_RATE;
+
+		if (value != NULL)
+			{
+				if (atoi (value) > 0)
+					rate = atoi (value);
+				g_free (value);
+			}
+		progress_interval = G_USEC_PER_SEC / rate;
+	}
+
+	g_free (progress_label);
+	progress_label = g_strdup_printf (_("Applying %s:"),
+	                                  strrchr (pspie->menu_path, '/') + 1);
+
+	expected_time = -1;
+	if (!dry_run)
+		expected_time = history_estimate (pspie->pdb_name,
+		                                  filter.filterRect.right - filter.filterRect.left,
+		                                  filter.filterRect.bottom - filter.filterRect.top,
+		                                  filter.planes);
+}
+
+static void
+finish_run (const PSPlugInEntry *pspie)
+{
+	PspiRun run;
+
+	if (dry_run)
+		return;
+
+	run.width = filter.filterRect.right - filter.filterRect.left;
+	run.height = filter.filterRect.bottom - filter.filterRect.top;
+	run.planes = filter.planes;
+	run.wall_time = g_timer_elapsed (run_timer, NULL);
+	run.host_time = host_usecs / 1e6;
+	run.bytes = bytes_in + bytes_out;
+
+	PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: %.3f s (host %.3f s, expected %.3f s), %" G_GUINT64_FORMAT " bytes\n",
+	                           __FUNCTION__, run.wall_time, run.host_time,
+	                           expected_time, run.bytes));
+
+	history_record (pspie->pdb_name, &run);
+}
+
+static void
+update_progress (void)
+{
+	const gint64 now = g_get_monotonic_time ();
+	const gdouble elapsed = g_timer_elapsed (run_timer, NULL);
+	const gdouble total = (gdouble) (filter.filterRect.right - filter.filterRect.left) *
+	                      (filter.filterRect.bottom - filter.filterRect.top) * filter.planes;
+	gdouble done;
+
+	/* What plug-ins report is often missing or far from linear. Go by
+	 * the output delivered so far too, and by how long earlier runs
+	 * took.
+	 */
+	done = MAX (plugin_progress, MIN (bytes_out / total, 1.0));
+
+	/* Completion is always shown, the rest at a limited rate */
+	if (done >= 1)
+		{
+			if (progress_shown >= 1)
+				return;
+		}
+	else
+		{
+			if (now - progress_shown_time < progress_interval)
+				return;
+			if (expected_time > 0)
+				done = (done + MIN (elapsed / expected_time, 0.99)) / 2;
+			if (ABS (done - progress_shown) < PROGRESS_MIN_DELTA)
+				return;
+		}
+
+	gimp_progress_update (done);
+	progress_shown = done;
+	progress_shown_time = now;
+
+	if (done > 0.01 && elapsed > 2)
+		{
+			gint left = elapsed * (1 - done) / done + 0.5;
+
+			if (left != eta_shown)
+				{
+					gimp_progress_set_text_printf (_("%s about %d s left"),
+					                               progress_label, left);
+					eta_shown = left;
+				}
+		}
 }
 
 static void
 progress_proc (long done,
                long total)
 {
-	gimp_progress_update ((float) done / total);
+	if (total > 0)
+		plugin_progress = CLAMP ((gdouble) done / total, 0.0, 1.0);
+	update_progress ();
 }
 
 static void
@@ -1150,18 +2280,56 @@ make_read_image_document_desc (void)
 
 #endif
 
-static void
-create_buf (guchar      **buf,
-            int32        *stride,
-            const Rect   *rect,
-            int           loplane,
-            int           hiplane)
+/* The buffers passed as inData and outData. The size is kept in front
+ * for the accounting.
+ */
+#define STAGING_HEADER_SIZE 16
+
+static guchar *
+staging_alloc (gsize size)
 {
-	const int nplanes = hiplane - loplane + 1;
-	const int w = (rect->right - rect->left);
-	const int h = (rect->bottom - rect->top);
+	guchar *p = g_malloc (STAGING_HEADER_SIZE + size);
 
-	*buf = g_malloc (nplanes * w * h);
+	*(gsize *) p = size;
+	memory_alloc (PSPI_MEMORY_STAGING, size);
+
+	return p + STAGING_HEADER_SIZE;
+}
+
+static guchar *
+staging_dup (const guchar *src,
+             gsize         size)
+{
+	guchar *p = staging_alloc (size);
+
+	memcpy (p, src, size);
+
+	return p;
+}
+
+static void
+staging_free (gpointer p)
+{
+	if (p == NULL)
+		return;
+
+	p = (guchar *) p - STAGING_HEADER_SIZE;
+	memory_free (PSPI_MEMORY_STAGING, *(gsize *) p);
+	g_free (p);
+}
+
+static void
+create_buf (guchar      **buf,
+            int32        *stride,
+            const Rect   *rect,
+            int           loplane,
+            int           hiplane)
+{
+	const int nplanes = hiplane - loplane + 1;
+	const int w = (rect->right - rect->left);
+	const int h = (rect->bottom - rect->top);
+
+	*buf = staging_alloc (nplanes * w * h);
 	*stride = nplanes * w;
 	PSPI_DEBUG (ADVANCE_STATE,
 	            g_print (G_STRLOC ":%s: nplanes=%d w=%d h=%d stride=%ld buf=%p\n",
@@ -1169,10 +2337,667 @@ create_buf (guchar      **buf,
 	                     nplanes, w, h, *stride, *buf));
 }
 
+/* Copy planes loplane..loplane+nplanes-1 of npixels pixels with bpp
+ * bytes each from src into the packed dest.
+ */
+static void
+gather_planes (guchar       *dest,
+               const guchar *src,
+               int           bpp,
+               int           loplane,
+               int           nplanes,
+               int           npixels)
+{
+	int i, j;
+
+	if (nplanes == bpp)
+		{
+			memcpy (dest, src, npixels * bpp);
+			return;
+		}
+
+	src += loplane;
+	if (nplanes == 1)
+		{
+			for (j = 0; j < npixels; j++)
+				dest[j] = src[j * bpp];
+			return;
+		}
+
+	for (j = 0; j < npixels; j++)
+		{
+			for (i = 0; i < nplanes; i++)
+				dest[i] = src[i];
+			dest += nplanes;
+			src += bpp;
+		}
+}
+
+/* The reverse of gather_planes(): merge the packed planes in src into
+ * the pixels in dest, leaving the other planes of dest alone.
+ */
+static void
+scatter_planes (guchar       *dest,
+                const guchar *src,
+                int           bpp,
+                int           loplane,
+                int           nplanes,
+                int           npixels)
+{
+	int i, j;
+
+	if (nplanes == bpp)
+		{
+			memcpy (dest, src, npixels * bpp);
+			return;
+		}
+
+	dest += loplane;
+	if (nplanes == 1)
+		{
+			for (j = 0; j < npixels; j++)
+				dest[j * bpp] = src[j];
+			return;
+		}
+
+	for (j = 0; j < npixels; j++)
+		{
+			for (i = 0; i < nplanes; i++)
+				dest[i] = src[i];
+			dest += bpp;
+			src += nplanes;
+		}
+}
+
+#ifdef HAVE_GEGL
+
+/* Babl component names of the planes, in the order Photoshop uses */
+static const gchar *const rgb_components[] = { "R'", "G'", "B'", "A" };
+static const gchar *const gray_components[] = { "Y'", "A" };
+
+/* Format with 8-bit planes loplane..loplane+nplanes-1 of the drawable.
+ * Babl does the conversion from whatever the drawable really is.
+ */
+static const Babl *
+planes_format (int loplane,
+               int nplanes)
+{
+	const gboolean rgb = gimp_drawable_is_rgb (drawable->drawable_id);
+	const gchar *const *components = rgb ? rgb_components : gray_components;
+	const gchar *model;
+
+	if (gimp_drawable_has_alpha (drawable->drawable_id))
+		model = rgb ? "R'G'B'A" : "Y'A";
+	else
+		model = rgb ? "R'G'B'" : "Y'";
+
+	switch (nplanes)
+		{
+		case 1:
+			return babl_format_new (babl_model (model), babl_type ("u8"),
+			                        babl_component (components[loplane]),
+			                        NULL);
+		case 2:
+			return babl_format_new (babl_model (model), babl_type ("u8"),
+			                        babl_component (components[loplane]),
+			                        babl_component (components[loplane+1]),
+			                        NULL);
+		case 3:
+			return babl_format_new (babl_model (model), babl_type ("u8"),
+			                        babl_component (components[loplane]),
+			                        babl_component (components[loplane+1]),
+			                        babl_component (components[loplane+2]),
+			                        NULL);
+		default:
+			return babl_format_new (babl_model (model), babl_type ("u8"),
+			                        babl_component (components[0]),
+			                        babl_component (components[1]),
+			                        babl_component (components[2]),
+			                        babl_component (components[3]),
+			                        NULL);
+		}
+}
+
+static GeglBuffer *src_buffer = NULL, *dst_buffer = NULL;
+
+static void
+open_pixels (void)
+{
+	src_buffer = gimp_drawable_get_buffer (drawable->drawable_id);
+	dst_buffer = gimp_drawable_get_shadow_buffer (drawable->drawable_id);
+}
+
+static void
+close_pixels (void)
+{
+	if (dst_buffer != NULL)
+		{
+			gegl_buffer_flush (dst_buffer);
+			g_object_unref (dst_buffer);
+			dst_buffer = NULL;
+		}
+	if (src_buffer != NULL)
+		{
+			g_object_unref (src_buffer);
+			src_buffer = NULL;
+		}
+}
+
+/* Read planes loplane..loplane+nplanes-1 of a rectangle that lies
+ * inside the drawable into buf.
+ */
+static void
+get_planes (guchar *buf,
+            int32   stride,
+            int     x,
+            int     y,
+            int     w,
+            int     h,
+            int     loplane,
+            int     nplanes)
+{
+	const GeglRectangle rect = { x, y, w, h };
+
+	gegl_buffer_get (src_buffer, &rect, 1.0, planes_format (loplane, nplanes),
+	                 buf, stride, GEGL_ABYSS_NONE);
+}
+
+/* Store planes loplane..loplane+nplanes-1 of a rectangle that lies
+ * inside the drawable from buf, keeping the other planes.
+ */
+static void
+put_planes (const guchar *buf,
+            int32         stride,
+            int           x,
+            int           y,
+            int           w,
+            int           h,
+            int           loplane,
+            int           nplanes)
+{
+	const GeglRectangle rect = { x, y, w, h };
+	guchar *pixels;
+	int row;
+
+	if (nplanes == pixel_bpp)
+		{
+			gegl_buffer_set (dst_buffer, &rect, 0, planes_format (0, pixel_bpp),
+			                 buf, stride);
+			return;
+		}
+
+	/* Setting a subset of the components would reset the others, so
+	 * merge into what is there already.
+	 */
+	pixels = g_malloc (pixel_bpp * w * h);
+	gegl_buffer_get (dst_buffer, &rect, 1.0, planes_format (0, pixel_bpp),
+	                 pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+	for (row = 0; row < h; row++)
+		scatter_planes (pixels + row * pixel_bpp * w, buf + row * stride,
+		                pixel_bpp, loplane, nplanes, w);
+	gegl_buffer_set (dst_buffer, &rect, 0, planes_format (0, pixel_bpp),
+	                 pixels, GEGL_AUTO_ROWSTRIDE);
+	g_free (pixels);
+}
+
+#else /* !HAVE_GEGL */
+
+static GimpPixelRgn src_rgn, dst_rgn;
+
+static void
+open_pixels (void)
+{
+	gimp_pixel_rgn_init (&src_rgn, drawable, 0, 0,
+	                     drawable->width, drawable->height, FALSE, FALSE);
+	gimp_pixel_rgn_init (&dst_rgn, drawable, 0, 0,
+	                     drawable->width, drawable->height, TRUE, TRUE);
+}
+
+static void
+close_pixels (void)
+{
+}
+
+static void
+get_planes (guchar *buf,
+            int32   stride,
+            int     x,
+            int     y,
+            int     w,
+            int     h,
+            int     loplane,
+            int     nplanes)
+{
+	const gint tile_h = gimp_tile_height ();
+	guchar *band;
+	gint y0, y1, row;
+
+	if (nplanes == pixel_bpp && stride == pixel_bpp * w)
+		{
+			gimp_pixel_rgn_get_rect (&src_rgn, buf, x, y, w, h);
+			return;
+		}
+
+	/* Fetch one row of tiles at a time and pick the wanted planes
+	 * out of it.
+	 */
+	band = g_malloc (pixel_bpp * w * tile_h);
+	for (y0 = y; y0 < y + h; y0 = y1)
+		{
+			y1 = MIN ((y0 / tile_h + 1) * tile_h, y + h);
+			gimp_pixel_rgn_get_rect (&src_rgn, band, x, y0, w, y1 - y0);
+			for (row = y0; row < y1; row++)
+				gather_planes (buf + (row - y) * stride,
+				               band + (row - y0) * pixel_bpp * w,
+				               pixel_bpp, loplane, nplanes, w);
+		}
+	g_free (band);
+}
+
+static void
+put_planes (const guchar *buf,
+            int32         stride,
+            int           x,
+            int           y,
+            int           w,
+            int           h,
+            int           loplane,
+            int           nplanes)
+{
+	const gint tile_h = gimp_tile_height ();
+	guchar *band;
+	gint y0, y1, row;
+
+	if (nplanes == pixel_bpp && stride == pixel_bpp * w)
+		{
+			gimp_pixel_rgn_set_rect (&dst_rgn, buf, x, y, w, h);
+			return;
+		}
+
+	/* Read-modify-write one row of tiles at a time, so that each tile
+	 * crosses the wire once in each direction instead of once per
+	 * scanline. With all planes present only the stride differs and
+	 * there is nothing to read.
+	 */
+	band = g_malloc (pixel_bpp * w * tile_h);
+	for (y0 = y; y0 < y + h; y0 = y1)
+		{
+			y1 = MIN ((y0 / tile_h + 1) * tile_h, y + h);
+			if (nplanes != pixel_bpp)
+				gimp_pixel_rgn_get_rect (&dst_rgn, band, x, y0, w, y1 - y0);
+			for (row = y0; row < y1; row++)
+				scatter_planes (band + (row - y0) * pixel_bpp * w,
+				                buf + (row - y) * stride,
+				                pixel_bpp, loplane, nplanes, w);
+			gimp_pixel_rgn_set_rect (&dst_rgn, band, x, y0, w, y1 - y0);
+		}
+	g_free (band);
+}
+
+#endif /* !HAVE_GEGL */
+
+/* The tile cache of the plug-in process is sized to hold a full row
+ * of tiles across the filter rectangle, both of the drawable and of
+ * its shadow, plus as many more rows as the plug-in's requests span.
+ * It only ever grows during a run, and never beyond the budget set
+ * with pspi-tile-cache-budget in gimprc.
+ */
+
+static gulong tile_bytes;
+static gulong tile_cache_ntiles;
+static gulong tile_cache_max;
+static gint tiles_across;
+
+/* What the plug-in's requests looked like, see access_profile() */
+static gint seen_tile_rows;
+static gboolean seen_plane_sweep, seen_whole;
+
+#ifdef PSPI_WITH_DEBUGGING
+/* For estimating the misses in the cache, LRU-style: when a tile was
+ * last touched, counted in tile accesses.
+ */
+static guint *tile_stamps = NULL;
+static guint tile_clock, tile_misses;
+
+static guint tiles_changed, tiles_unchanged;
+#endif
+
+static void
+grow_tile_cache (gint tile_rows)
+{
+	gulong ntiles = MIN (2 * tiles_across * tile_rows, tile_cache_max);
+
+	if (ntiles <= tile_cache_ntiles)
+		return;
+
+	tile_cache_ntiles = ntiles;
+#ifdef HAVE_GEGL
+	{
+		guint64 size;
+
+		g_object_get (gegl_config (), "tile-cache-size", &size, NULL);
+		if (size < ntiles * tile_bytes)
+			g_object_set (gegl_config (), "tile-cache-size",
+			              (guint64) ntiles * tile_bytes, NULL);
+	}
+#else
+	gimp_tile_cache_ntiles (ntiles);
+#endif
+	PSPI_DEBUG (TILE_CACHE, g_print (G_STRLOC ":%s: %d rows of %d tiles: %lu tiles, %lu kB\n",
+	                                 __FUNCTION__,
+	                                 tile_rows, tiles_across,
+	                                 ntiles, (ntiles * tile_bytes) >> 10));
+}
+
+/* Tile rows spanned by the filtered area */
+static gint
+filter_tile_rows (void)
+{
+	const gint th = gimp_tile_height ();
+
+	return (filter.filterRect.bottom - 1) / th - filter.filterRect.top / th + 1;
+}
+
+static void
+setup_tile_cache (const gchar *profile)
+{
+	const gint tw = gimp_tile_width ();
+	gchar *value;
+	gulong budget = DEFAULT_TILE_CACHE_BUDGET;
+
+	if ((value = gimp_gimprc_query (PSPI_TILE_CACHE_BUDGET_TOKEN)) != NULL)
+		{
+			if (atoi (value) > 0)
+				budget = atoi (value);
+			g_free (value);
+		}
+
+#ifdef HAVE_GEGL
+	tile_bytes = tw * gimp_tile_height () * gimp_drawable_bpp (drawable->drawable_id);
+#else
+	tile_bytes = tw * gimp_tile_height () * drawable->bpp;
+#endif
+	/* In megabytes, which may not fit in 32 bits as bytes */
+	tile_cache_max = MIN (((guint64) budget << 20) / tile_bytes, G_MAXULONG);
+	tiles_across = (filter.filterRect.right - 1) / tw - filter.filterRect.left / tw + 1;
+	tile_cache_ntiles = 0;
+
+	seen_tile_rows = 0;
+	seen_plane_sweep = seen_whole = FALSE;
+
+	/* Size the cache for what the plug-in did the last time. Without
+	 * a profile, until the plug-in shows otherwise, assume one row of
+	 * tiles plus the next for the kernel margin.
+	 */
+	if (profile == NULL)
+		grow_tile_cache (2);
+	else if (strncmp (profile, "bands:", 6) == 0)
+		grow_tile_cache (MAX (atoi (profile + 6), 2));
+	else
+		grow_tile_cache (filter_tile_rows ());
+
+#ifdef PSPI_WITH_DEBUGGING
+	if (debug_mask & PSPI_DEBUG_TILE_CACHE)
+		{
+			g_free (tile_stamps);
+			tile_stamps = g_new0 (guint, drawable->ntile_rows * drawable->ntile_cols);
+			tile_clock = tile_misses = 0;
+		}
+#endif
+}
+
+/* Adapt the tile cache to a request for rect. */
+static void
+note_tile_access (const Rect *rect)
+{
+	const gint tw = gimp_tile_width (), th = gimp_tile_height ();
+	const gint top = MAX (rect->top, 0) / th;
+	const gint bottom = (MIN (rect->bottom, drawable->height) - 1) / th;
+
+	if (bottom < top)
+		return;
+
+	seen_tile_rows = MAX (seen_tile_rows, bottom - top + 2);
+	grow_tile_cache (bottom - top + 2);
+
+#ifdef PSPI_WITH_DEBUGGING
+	if (tile_stamps != NULL)
+		{
+			const gint left = MAX (rect->left, 0) / tw;
+			const gint right = (MIN (rect->right, drawable->width) - 1) / tw;
+			gint row, col;
+
+			for (row = top; row <= bottom; row++)
+				for (col = left; col <= right; col++)
+					{
+						guint *stamp = tile_stamps + row * drawable->ntile_cols + col;
+
+						/* Touched before, but since then more
+						 * other tiles than fit in the cache.
+						 */
+						if (*stamp != 0 && tile_clock - *stamp >= tile_cache_ntiles)
+							tile_misses++;
+						*stamp = ++tile_clock;
+					}
+		}
+#endif
+}
+
+/* The tiles written to during the run, one byte per tile, and the
+ * bounding box of the pixels written.
+ */
+static guchar *dirty_tiles = NULL;
+static gint dirty_x1, dirty_y1, dirty_x2, dirty_y2;
+
+static void
+reset_dirty (void)
+{
+	g_free (dirty_tiles);
+	dirty_tiles = g_new0 (guchar, drawable->ntile_rows * drawable->ntile_cols);
+	dirty_x1 = dirty_y1 = G_MAXINT;
+	dirty_x2 = dirty_y2 = 0;
+}
+
+static void
+mark_dirty (gint x,
+            gint y,
+            gint w,
+            gint h)
+{
+	const gint tw = gimp_tile_width (), th = gimp_tile_height ();
+	gint row, col, x2, y2;
+
+	/* Filters asking for padding pass areas partly outside */
+	x2 = MIN (x + w, (gint) drawable->width);
+	y2 = MIN (y + h, (gint) drawable->height);
+	x = MAX (x, 0);
+	y = MAX (y, 0);
+	w = x2 - x;
+	h = y2 - y;
+
+	if (w <= 0 || h <= 0)
+		return;
+
+	dirty_x1 = MIN (dirty_x1, x);
+	dirty_y1 = MIN (dirty_y1, y);
+	dirty_x2 = MAX (dirty_x2, x + w);
+	dirty_y2 = MAX (dirty_y2, y + h);
+
+	for (row = y / th; row <= (y + h - 1) / th; row++)
+		for (col = x / tw; col <= (x + w - 1) / tw; col++)
+			dirty_tiles[row * drawable->ntile_cols + col] = TRUE;
+}
+
+gboolean
+pspi_dirty_bounds (gint *x,
+                   gint *y,
+                   gint *width,
+                   gint *height)
+{
+	if (dirty_x2 <= dirty_x1 || dirty_y2 <= dirty_y1)
+		return FALSE;
+
+	*x = dirty_x1;
+	*y = dirty_y1;
+	*width = dirty_x2 - dirty_x1;
+	*height = dirty_y2 - dirty_y1;
+
+	return TRUE;
+}
+
+#define MAX_DIRTY_UPDATES 32
+
+/* Update the display for the written tiles only. Horizontal runs of
+ * dirty tiles become one rectangle, and identical runs in consecutive
+ * tile rows are merged. If that still gives too many rectangles, just
+ * update the bounding box.
+ */
+void
+pspi_update_dirty (void)
+{
+	const gint tw = gimp_tile_width (), th = gimp_tile_height ();
+	const gint ncols = drawable->ntile_cols;
+	GArray *rects, *runs, *prev_runs;
+	gint row, col, i, first_pending = 0;
+
+	if (dirty_x2 <= dirty_x1 || dirty_y2 <= dirty_y1)
+		return;
+
+	rects = g_array_new (FALSE, FALSE, sizeof (PspiRect));
+	runs = g_array_new (FALSE, FALSE, sizeof (gint));
+	prev_runs = g_array_new (FALSE, FALSE, sizeof (gint));
+
+	for (row = dirty_y1 / th; row <= (dirty_y2 - 1) / th; row++)
+		{
+			const guchar *tiles = dirty_tiles + row * ncols;
+			GArray *tmp;
+
+			g_array_set_size (runs, 0);
+			for (col = 0; col < ncols; col++)
+				if (tiles[col] && (col == 0 || !tiles[col - 1]))
+					g_array_append_val (runs, col);
+				else if (!tiles[col] && col > 0 && tiles[col - 1])
+					g_array_append_val (runs, col);
+			if (runs->len % 2)
+				g_array_append_val (runs, ncols);
+
+			if (runs->len > 0 && runs->len == prev_runs->len &&
+			    memcmp (runs->data, prev_runs->data, runs->len * sizeof (gint)) == 0)
+				{
+					/* Same runs as in the previous row: extend */
+					for (i = first_pending; i < rects->len; i++)
+						g_array_index (rects, PspiRect, i).y2 = (row + 1) * th;
+				}
+			else
+				{
+					first_pending = rects->len;
+					for (i = 0; i < runs->len; i += 2)
+						{
+							PspiRect r;
+
+							r.x1 = g_array_index (runs, gint, i) * tw;
+							r.x2 = g_array_index (runs, gint, i + 1) * tw;
+							r.y1 = row * th;
+							r.y2 = (row + 1) * th;
+							g_array_append_val (rects, r);
+						}
+				}
+
+			tmp = prev_runs;
+			prev_runs = runs;
+			runs = tmp;
+		}
+
+	if (rects->len > MAX_DIRTY_UPDATES)
+		{
+			PSPI_DEBUG (ADVANCE_STATE, g_print (G_STRLOC ":%s: %d areas, updating bounding box\n",
+			                                    __FUNCTION__, rects->len));
+			gimp_drawable_update (drawable->drawable_id, dirty_x1, dirty_y1,
+			                      dirty_x2 - dirty_x1, dirty_y2 - dirty_y1);
+		}
+	else
+		for (i = 0; i < rects->len; i++)
+			{
+				PspiRect *r = &g_array_index (rects, PspiRect, i);
+
+				/* The written pixels are within the bounding box */
+				r->x1 = MAX (r->x1, dirty_x1);
+				r->y1 = MAX (r->y1, dirty_y1);
+				r->x2 = MIN (r->x2, dirty_x2);
+				r->y2 = MIN (r->y2, dirty_y2);
+				PSPI_DEBUG (ADVANCE_STATE, g_print (G_STRLOC ":%s: %dx%d%+d%+d\n",
+				                                 __FUNCTION__,
+				                                 r->x2 - r->x1, r->y2 - r->y1, r->x1, r->y1));
+				gimp_drawable_update (drawable->drawable_id, r->x1, r->y1,
+				                      r->x2 - r->x1, r->y2 - r->y1);
+			}
+
+	g_array_free (rects, TRUE);
+	g_array_free (runs, TRUE);
+	g_array_free (prev_runs, TRUE);
+}
+
+/* A short description of the plug-in's requests, for sizing the
+ * tile cache up front next time: "whole" if it asked for all of the
+ * filtered area at once, "planes" if it went over it plane by plane,
+ * otherwise "bands:N" with the rows of tiles it needed at a time.
+ * Both of the former need all of the area in the cache.
+ */
+static gchar *
+access_profile (void)
+{
+	if (seen_whole)
+		return g_strdup ("whole");
+	if (seen_plane_sweep && seen_tile_rows < filter_tile_rows ())
+		return g_strdup ("planes");
+	return g_strdup_printf ("bands:%d", seen_tile_rows);
+}
+
+static void
+learn_access_profile (PSPlugInEntry *pspie)
+{
+	gchar *profile;
+
+	if (dry_run)
+		return;
+
+	profile = access_profile ();
+	if (pspie->access_profile == NULL ||
+	        strcmp (profile, pspie->access_profile) != 0)
+		{
+			PSPI_DEBUG (TILE_CACHE, g_print (G_STRLOC ":%s: access profile %s, was %s\n",
+			                                 __FUNCTION__, profile,
+			                                 pspie->access_profile ? pspie->access_profile : "unknown"));
+			g_free (pspie->access_profile);
+			pspie->access_profile = profile;
+			save_learned (pspie);
+		}
+	else
+		g_free (profile);
+}
+
+static void
+report_tile_cache (void)
+{
+#ifdef PSPI_WITH_DEBUGGING
+	PSPI_DEBUG (ADVANCE_STATE, g_print ("pspi: %u tiles changed, %u unchanged\n",
+	                                    tiles_changed, tiles_unchanged));
+	tiles_changed = tiles_unchanged = 0;
+
+	if (tile_stamps != NULL)
+		{
+			g_print ("pspi: tile cache %lu tiles (%lu kB), %u tile accesses, about %u misses\n",
+			         tile_cache_ntiles, (tile_cache_ntiles * tile_bytes) >> 10,
+			         tile_clock, tile_misses);
+			g_free (tile_stamps);
+			tile_stamps = NULL;
+		}
+#endif
+}
+
 static void
 fill_buf (guchar      **buf,
           int32        *stride,
-          GimpPixelRgn *pr,
           const Rect   *rect,
           int           loplane,
           int           hiplane)
@@ -1197,7 +3022,7 @@ fill_buf (guchar      **buf,
 			/* At least part of the requested area is outside the drawable.
 			 * Clear all of it for a start, then.
 			 */
-			memset (*buf, h * *stride, 0);
+			memset (*buf, 0, h * *stride);
 		}
 
 	if (rect->left < drawable->width &&
@@ -1216,33 +3041,9 @@ fill_buf (guchar      **buf,
 			PSPI_DEBUG (ADVANCE_STATE, if (gimpw != w || gimph != h)
                   g_print ("  gimpw=%d gimph=%d\n", gimpw, gimph));
 
-			if (nplanes == pr->bpp && gimpw == w)
-				{
-					gimp_pixel_rgn_get_rect (pr, *buf, rect->left, rect->top,
-					                         gimpw, gimph);
-				}
-			else
-				{
-					guchar *row = g_malloc (pr->bpp * gimpw);
-					gint i, j, y;
-
-					for (y = rect->top; y < rect->top + gimph; y++)
-						{
-							gimp_pixel_rgn_get_row (pr, row, rect->left, y, gimpw);
-							for (i = loplane; i <= hiplane; i++)
-								{
-									guchar *p = row + i;
-									guchar *q = *buf + (y - rect->top) * *stride + (i - loplane);
-									for (j = 0; j < gimpw; j++)
-										{
-											*q = *p;
-											p += pr->bpp;
-											q += nplanes;
-										}
-								}
-						}
-					g_free (row);
-				}
+			get_planes (*buf, *stride, rect->left, rect->top, gimpw, gimph,
+			            loplane, nplanes);
+			bytes_in += (guint64) gimpw * gimph * nplanes;
 		}
 
 #ifdef PSPI_WITH_DEBUGGING
@@ -1261,10 +3062,87 @@ fill_buf (guchar      **buf,
 #endif /* PSPI_WITH_DEBUGGING */
 }
 
+/* Whether the rows y0..y1-1 of a w bytes wide column at x differ
+ * between a and b.
+ */
+static gboolean
+area_changed (const guchar *a,
+              const guchar *b,
+              int32         stride,
+              int           x,
+              int           y0,
+              int           y1,
+              int           w)
+{
+	int y;
+
+	for (y = y0; y < y1; y++)
+		if (memcmp (a + y * stride + x, b + y * stride + x, w) != 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Store a rectangle inside the drawable, but mark dirty only those
+ * tiles in which buf differs from orig, the pixels it was filled
+ * with. Unchanged tiles must still go to the shadow, as merging it
+ * takes the whole selection.
+ */
+static void
+store_changed (const guchar *buf,
+               const guchar *orig,
+               int32         stride,
+               int           x,
+               int           y,
+               int           w,
+               int           h,
+               int           loplane,
+               int           nplanes)
+{
+	const gint tw = gimp_tile_width (), th = gimp_tile_height ();
+	gint x0, x1, y0, y1, run;
+
+	put_planes (buf, stride, x, y, w, h, loplane, nplanes);
+
+	for (y0 = y; y0 < y + h; y0 = y1)
+		{
+			y1 = MIN ((y0 / th + 1) * th, y + h);
+			run = -1;
+			for (x0 = x; x0 <= x + w; x0 = x1)
+				{
+					gboolean changed = FALSE;
+
+					x1 = MIN ((x0 / tw + 1) * tw, x + w);
+					if (x0 < x + w)
+						{
+							changed = area_changed (buf, orig, stride,
+							                        (x0 - x) * nplanes, y0 - y, y1 - y,
+							                        (x1 - x0) * nplanes);
+#ifdef PSPI_WITH_DEBUGGING
+							if (changed)
+								tiles_changed++;
+							else
+								tiles_unchanged++;
+#endif
+						}
+					else
+						x1 = x0 + 1;
+
+					if (changed && run < 0)
+						run = x0;
+					else if (!changed && run >= 0)
+						{
+							mark_dirty (run, y0, x0 - run, y1 - y0);
+							run = -1;
+						}
+				}
+		}
+}
+
 static void
 store_buf (guchar       *buf,
+           const guchar *orig,
            int32         stride,
-           GimpPixelRgn *pr,
            const Rect   *rect,
            int           loplane,
            int           hiplane)
@@ -1292,6 +3170,9 @@ store_buf (guchar       *buf,
 		}
 #endif /* PSPI_WITH_DEBUGGING */
 
+	if (dry_run)
+		return;
+
 	if (rect->left < drawable->width &&
 	        rect->top < drawable->height)
 		{
@@ -1307,45 +3188,52 @@ store_buf (guchar       *buf,
 
 			PSPI_DEBUG (ADVANCE_STATE, if (gimpw != w || gimph != h) g_print ("  gimpw=%d gimph=%d\n", gimpw, gimph));
 
-			if (nplanes == pr->bpp && gimpw == w)
-				{
-					gimp_pixel_rgn_set_rect (pr, buf, rect->left, rect->top,
-					                         gimpw, gimph);
-				}
+			if (orig != NULL)
+				store_changed (buf, orig, stride, rect->left, rect->top,
+				               gimpw, gimph, loplane, nplanes);
 			else
 				{
-					guchar *row = g_malloc (pr->bpp * gimpw);
-					gint i, j, y;
-
-					for (y = rect->top; y < rect->top + gimph; y++)
-						{
-							gimp_pixel_rgn_get_row (pr, row, rect->left, y, gimpw);
-							for (i = loplane; i <= hiplane; i++)
-								{
-									guchar *p = row + i;
-									guchar *q = buf + (y - rect->top) * stride + (i - loplane);
-									for (j = 0; j < gimpw; j++)
-										{
-											*p = *q;
-											p += pr->bpp;
-											q += nplanes;
-										}
-								}
-							gimp_pixel_rgn_set_row (pr, row, rect->left, y, gimpw);
-						}
-					g_free (row);
+					put_planes (buf, stride, rect->left, rect->top, gimpw, gimph,
+					            loplane, nplanes);
+					mark_dirty (rect->left, rect->top, gimpw, gimph);
 				}
+			bytes_out += (guint64) gimpw * gimph * nplanes;
+			update_progress ();
 		}
 }
 
+/* The buffers handed to the plug-in by advance_state_proc(), kept
+ * until its next call.
+ */
+static gboolean src_valid = FALSE, dst_valid = FALSE, dst_aliased = FALSE;
+static Rect outRect;
+static gint outRowBytes, outLoPlane, outHiPlane;
+static guchar *outOrig = NULL;	/* What outData was filled with */
+static gboolean outOrigOwned = FALSE;
+
+/* Drop the buffers of the last advance_state_proc() without storing
+ * them, so that a run that failed half-way leaves nothing for the
+ * next run in the same process.
+ */
+static void
+advance_state_reset (void)
+{
+	if (dst_valid && !dst_aliased)
+		staging_free (filter.outData);
+	if (outOrigOwned)
+		staging_free (outOrig);
+	if (src_valid)
+		staging_free (filter.inData);
+	filter.inData = filter.outData = NULL;
+	outOrig = NULL;
+	src_valid = dst_valid = dst_aliased = outOrigOwned = FALSE;
+}
+
 static OSErr
 advance_state_proc (void)
 {
-	/* Ugly, ugly */
-	static gboolean src_valid = FALSE, dst_valid = FALSE;
-	static GimpPixelRgn src, dst;
-	static Rect outRect;
-	static gint outRowBytes, outLoPlane, outHiPlane;
+	const gint64 start = g_get_monotonic_time ();
+	gboolean same_area;
 
 #ifdef PSPI_WITH_DEBUGGING
 	if (debug_mask & PSPI_DEBUG_ADVANCE_STATE)
@@ -1361,30 +3249,48 @@ advance_state_proc (void)
 		}
 #endif /* PSPI_WITH_DEBUGGING */
 
-	if (src_valid)
-		{
-			g_free (filter.inData);
-			filter.inData = NULL;
-			src_valid = FALSE;
-		}
-
 	if (dst_valid)
 		{
 			PSPI_DEBUG (ADVANCE_STATE, g_print ("  outData:\n"));
-			store_buf ((guchar *) filter.outData, outRowBytes, &dst, &outRect,
+			store_buf ((guchar *) filter.outData, outOrig, outRowBytes, &outRect,
 			           outLoPlane, outHiPlane);
-			g_free (filter.outData);
+			if (!dst_aliased)
+				staging_free (filter.outData);
+			if (outOrigOwned)
+				staging_free (outOrig);
 			filter.outData = NULL;
+			outOrig = NULL;
 			dst_valid = FALSE;
+			dst_aliased = FALSE;
+			outOrigOwned = FALSE;
+		}
+
+	if (src_valid)
+		{
+			staging_free (filter.inData);
+			filter.inData = NULL;
+			src_valid = FALSE;
 		}
 
+	/* The common case of a filter reading and writing the very same
+	 * pixels: fetch them only once.
+	 */
+	same_area = (RECT_NONEMPTY (filter.inRect) &&
+	             RECT_EQUAL (filter.inRect, filter.outRect) &&
+	             filter.inLoPlane == filter.outLoPlane &&
+	             filter.inHiPlane == filter.outHiPlane);
+
 	if (RECT_NONEMPTY (filter.inRect))
 		{
-			gimp_pixel_rgn_init (&src, drawable, filter.inRect.left, filter.inRect.top,
-			                     filter.inRect.right - filter.inRect.left,
-			                     filter.inRect.bottom - filter.inRect.top,
-			                     FALSE, FALSE);
-			fill_buf ((guchar **) &filter.inData, &filter.inRowBytes, &src,
+			if (filter.inHiPlane - filter.inLoPlane + 1 < filter.planes)
+				seen_plane_sweep = TRUE;
+			if (filter.inRect.top <= filter.filterRect.top &&
+			        filter.inRect.left <= filter.filterRect.left &&
+			        filter.inRect.bottom >= filter.filterRect.bottom &&
+			        filter.inRect.right >= filter.filterRect.right)
+				seen_whole = TRUE;
+			note_tile_access (&filter.inRect);
+			fill_buf ((guchar **) &filter.inData, &filter.inRowBytes,
 			          &filter.inRect, filter.inLoPlane, filter.inHiPlane);
 			src_valid = TRUE;
 		}
@@ -1393,17 +3299,42 @@ advance_state_proc (void)
 
 	if (RECT_NONEMPTY (filter.outRect))
 		{
-			GimpPixelRgn src2;
-			gimp_pixel_rgn_init (&src2, drawable, filter.outRect.left, filter.outRect.top,
-			                     filter.outRect.right - filter.outRect.left,
-			                     filter.outRect.bottom - filter.outRect.top,
-			                     FALSE, FALSE);
-			gimp_pixel_rgn_init (&dst, drawable, filter.outRect.left, filter.outRect.top,
-			                     filter.outRect.right - filter.outRect.left,
-			                     filter.outRect.bottom - filter.outRect.top,
-			                     TRUE, TRUE);
-			fill_buf ((guchar **) &filter.outData, &filter.outRowBytes, &src,
-			          &filter.outRect, filter.outLoPlane, filter.outHiPlane);
+			note_tile_access (&filter.outRect);
+			if (same_area)
+				{
+					/* Plug-ins known to cope get the input buffer
+					 * itself, others a copy of it.
+					 */
+					filter.outRowBytes = filter.inRowBytes;
+					if (in_place)
+						filter.outData = filter.inData;
+					else
+						filter.outData = staging_dup (filter.inData,
+						                           filter.inRowBytes * (filter.inRect.bottom - filter.inRect.top));
+					dst_aliased = in_place;
+					PSPI_DEBUG (ADVANCE_STATE, g_print ("  outData %s inData\n",
+					                                    in_place ? "is" : "copied from"));
+
+					/* inData is read-only, so it can serve for
+					 * spotting unchanged output. Not when it is
+					 * the output, though.
+					 */
+					outOrig = (compare_output && !in_place) ? filter.inData : NULL;
+				}
+			else
+				{
+					fill_buf ((guchar **) &filter.outData, &filter.outRowBytes,
+					          &filter.outRect, filter.outLoPlane, filter.outHiPlane);
+					/* The copy and compare only shrink the area
+					 * updated on screen, so only on request.
+					 */
+					if (compare_output)
+						{
+							outOrig = staging_dup (filter.outData,
+							                       filter.outRowBytes * (filter.outRect.bottom - filter.outRect.top));
+							outOrigOwned = TRUE;
+						}
+				}
 			outRowBytes = filter.outRowBytes;
 			outRect = filter.outRect;
 			outLoPlane = filter.outLoPlane;
@@ -1413,6 +3344,8 @@ advance_state_proc (void)
 	else
 		filter.outData = NULL;
 
+	host_usecs += g_get_monotonic_time () - start;
+
 	return noErr;
 }
 
@@ -1685,6 +3618,110 @@ query_8bf (const gchar       *file,
 	FreeLibrary (dll);
 }
 
+/* The Buffer and Handle suites, on top of the BufferProcs and
+ * HandleProcs callbacks.
+ */
+static SPAPI Ptr
+buffer_suite_new (uint32 *requestedSize,
+                  uint32  minimumSize)
+{
+	BufferID buffer;
+	uint32 size = (requestedSize != NULL ? *requestedSize : minimumSize);
+
+	/* The sizes are unsigned here, but BufferProcs take an int32 */
+	if (size > G_MAXINT32 || buffer_allocate_proc ((int32) size, &buffer) != noErr)
+		{
+			size = minimumSize;
+			if (size > G_MAXINT32 || buffer_allocate_proc ((int32) size, &buffer) != noErr)
+				return NULL;
+		}
+	if (requestedSize != NULL)
+		*requestedSize = size;
+
+	return (Ptr) buffer;
+}
+
+static SPAPI void
+buffer_suite_dispose (Ptr *buffer)
+{
+	if (buffer != NULL && *buffer != NULL)
+		{
+			buffer_free_proc ((BufferID) *buffer);
+			*buffer = NULL;
+		}
+}
+
+static SPAPI uint32
+buffer_suite_get_size (Ptr buffer)
+{
+	if (buffer == NULL)
+		return 0;
+
+	return ((PspiBuffer *) (buffer - BUFFER_HEADER_SIZE))->size;
+}
+
+static SPAPI uint32
+buffer_suite_get_space (void)
+{
+	return buffer_space_proc ();
+}
+
+static SPAPI void
+handle_suite_set_lock (Handle   h,
+                       Boolean  lock,
+                       Ptr     *address,
+                       Boolean *oldLock)
+{
+	/* Handles never move, so the lock state doesn't matter */
+	if (oldLock != NULL)
+		*oldLock = FALSE;
+	if (lock)
+		{
+			Ptr p = handle_lock_proc (h, FALSE);
+
+			if (address != NULL)
+				*address = p;
+		}
+	else
+		handle_unlock_proc (h);
+}
+
+static void
+setup_spbasic_suites (void)
+{
+	PSBufferSuite1 *buffer_suite = g_new (PSBufferSuite1, 1);
+	PSHandleSuite1 *handle_suite1 = g_new (PSHandleSuite1, 1);
+	PSHandleSuite2 *handle_suite = g_new (PSHandleSuite2, 1);
+	PspiPropertySuite1 *property_suite = g_new (PspiPropertySuite1, 1);
+
+	buffer_suite->New = buffer_suite_new;
+	buffer_suite->Dispose = buffer_suite_dispose;
+	buffer_suite->GetSize = buffer_suite_get_size;
+	buffer_suite->GetSpace = buffer_suite_get_space;
+	register_suite (kPSBufferSuite, kPSBufferSuiteVersion1, buffer_suite);
+
+	handle_suite1->New = handle_new_proc;
+	handle_suite1->Dispose = handle_dispose_proc;
+	handle_suite1->SetLock = handle_suite_set_lock;
+	handle_suite1->GetSize = handle_get_size_proc;
+	handle_suite1->SetSize = handle_set_size_proc;
+	handle_suite1->RecoverSpace = handle_recover_space_proc;
+	register_suite (kPSHandleSuite, kPSHandleSuiteVersion1, handle_suite1);
+
+	handle_suite->New = handle_new_proc;
+	handle_suite->Dispose = handle_dispose_proc;
+	handle_suite->DisposeRegularHandle = handle_dispose_regular_proc;
+	handle_suite->SetLock = handle_suite_set_lock;
+	handle_suite->GetSize = handle_get_size_proc;
+	handle_suite->SetSize = handle_set_size_proc;
+	handle_suite->RecoverSpace = handle_recover_space_proc;
+	register_suite (kPSHandleSuite, kPSHandleSuiteVersion2, handle_suite);
+
+	property_suite->getPropertyProc = property_get_proc;
+	property_suite->setPropertyProc = property_set_proc;
+	register_suite (PSPI_PROPERTY_SUITE, 1, property_suite);
+}
+
 static void
 setup_suites (void)
 {
@@ -1757,26 +3794,17 @@ setup_suites (void)
 	basic_suite->FreeBlock = SPBasicFreeBlock;
 	basic_suite->ReallocateBlock = SPBasicReallocateBlock;
 	basic_suite->Undefined = SPBasicUndefined;
+
+	setup_spbasic_suites ();
 }
 
+/* The colours can change between runs of the resident host */
 static void
-setup_filter_record (void)
+setup_colors (void)
 {
-	static gboolean beenhere = FALSE;
 	guchar red, green, blue;
 	GimpRGB back, fore;
 
-	if (beenhere)
-		return;
-
-	beenhere = TRUE;
-
-	platform.hwnd = 0;
-
-	filter.serialNumber = 0;
-	filter.abortProc = abort_proc;
-	filter.progressProc = progress_proc;
-	filter.parameters = NULL;
 	gimp_palette_get_background (&back);
 	gimp_rgb_get_uchar (&back, &red, &green, &blue);
 	filter.background.red = (red * 65535) / 255;
@@ -1795,6 +3823,30 @@ setup_filter_record (void)
 	filter.foreColor[1] = green;
 	filter.foreColor[2] = blue;
 	filter.foreColor[3] = 0xFF;
+}
+
+static void
+setup_filter_record (void)
+{
+	static gboolean beenhere = FALSE;
+
+	if (!colors_current)
+		{
+			setup_colors ();
+			colors_current = TRUE;
+		}
+
+	if (beenhere)
+		return;
+
+	beenhere = TRUE;
+
+	platform.hwnd = 0;
+
+	filter.serialNumber = 0;
+	filter.abortProc = abort_proc;
+	filter.progressProc = progress_proc;
+	filter.parameters = NULL;
 	filter.maxSpace = 100000000;
 	memcpy ((char *) &filter.hostSig, "GIMP", 4);
 	filter.hostProc = host_proc;
@@ -1828,20 +3880,12 @@ setup_filter_record (void)
 
 	filter.imageServicesProcs = image_services_procs;
 	filter.propertyProcs = property_procs;
-	filter.inTileHeight = gimp_tile_height ();
-	filter.inTileWidth = gimp_tile_width ();
 	filter.inTileOrigin.h = 0;
 	filter.inTileOrigin.v = 0;
-	filter.absTileHeight = filter.inTileHeight;
-	filter.absTileWidth = filter.inTileWidth;
 	filter.absTileOrigin.h = 0;
 	filter.absTileOrigin.v = 0;
-	filter.outTileHeight = filter.inTileHeight;
-	filter.outTileWidth = filter.inTileWidth;
 	filter.outTileOrigin.h = 0;
 	filter.outTileOrigin.v = 0;
-	filter.maskTileHeight = filter.inTileHeight;
-	filter.maskTileWidth = filter.inTileWidth;
 	filter.maskTileOrigin.h = 0;
 	filter.maskTileOrigin.v = 0;
 
@@ -1849,7 +3893,7 @@ setup_filter_record (void)
 	filter.channelPortProcs = NULL /* channel_port_procs */;
 	filter.documentInfo = NULL;
 
-	filter.sSPBasic = NULL /* basic_suite */;
+	filter.sSPBasic = basic_suite;
 	filter.plugInRef = NULL;
 	filter.depth = 8;
 
@@ -1860,28 +3904,57 @@ setup_filter_record (void)
 	memset (filter.reserved, 0, sizeof (filter.reserved));
 }
 
+/* The tile size we advertise. Only a hint, but plug-ins that honour
+ * it run at quite different speeds depending on it.
+ */
+static void
+setup_tile_sizes (gint size)
+{
+	if (size > 0)
+		{
+			filter.inTileHeight = size;
+			filter.inTileWidth = size;
+		}
+	else
+		{
+			filter.inTileHeight = gimp_tile_height ();
+			filter.inTileWidth = gimp_tile_width ();
+		}
+	filter.absTileHeight = filter.inTileHeight;
+	filter.absTileWidth = filter.inTileWidth;
+	filter.outTileHeight = filter.inTileHeight;
+	filter.outTileWidth = filter.inTileWidth;
+	filter.maskTileHeight = filter.inTileHeight;
+	filter.maskTileWidth = filter.inTileWidth;
+}
+
 static void
 setup_sizes (void)
 {
 	gint x1, y1, x2, y2;
-	gdouble xres, yres;
 
 	filter.imageSize.h = drawable->width;
 	filter.imageSize.v = drawable->height;
-	filter.planes = drawable->bpp;
+	filter.planes = pixel_bpp;
 	gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
 	filter.filterRect.top = y1;
 	filter.filterRect.left = x1;
 	filter.filterRect.bottom = y2;
 	filter.filterRect.right = x2;
 
-	gimp_image_get_resolution (image_id, &xres, &yres);
-	filter.imageHRes = long2fixed ((long) (xres + 0.5));
-	filter.imageVRes = long2fixed ((long) (yres + 0.5));
+	/* When autotuning, filter just a sample from the top left */
+	if (tune_tile_size > 0)
+		{
+			filter.filterRect.bottom = MIN (y2, y1 + AUTOTUNE_SAMPLE_SIZE);
+			filter.filterRect.right = MIN (x2, x1 + AUTOTUNE_SAMPLE_SIZE);
+		}
+
+	filter.imageHRes = long2fixed ((long) (image_props.xres + 0.5));
+	filter.imageVRes = long2fixed ((long) (image_props.yres + 0.5));
 	filter.floatCoord.h = x1;
 	filter.floatCoord.v = y1;
-	filter.wholeSize.h = gimp_image_width (image_id);
-	filter.wholeSize.v = gimp_image_height (image_id);
+	filter.wholeSize.h = image_props.width;
+	filter.wholeSize.v = image_props.height;
 }
 
 static GimpPDBStatusType
@@ -1955,19 +4028,329 @@ error_message (int16  result,
 						}
 					emsg = g_strdup_printf ("%s: %s", phase, s);
 				}
-			g_message (_("pspi: Problem invoking Photoshop plug-in: %s"), emsg);
-			g_free (emsg);
-			return GIMP_PDB_EXECUTION_ERROR;
+			g_message (_("pspi: Problem invoking Photoshop plug-in: %s"), emsg);
+			g_free (emsg);
+			return GIMP_PDB_EXECUTION_ERROR;
+		}
+}
+
+static gint
+parameters_kind (gint *size)
+{
+	*size = 0;
+
+	if (filter.parameters == NULL)
+		return PSPI_PARAMETERS_NONE;
+
+	if (handle_valid (filter.parameters))
+		{
+			*size = handle_get_size_proc ((Handle) filter.parameters);
+			return PSPI_PARAMETERS_HANDLE;
+		}
+	else if ((*size = GlobalSize ((HGLOBAL) filter.parameters)) > 0)
+		return PSPI_PARAMETERS_HGLOBAL;
+	else if (!IsBadReadPtr (filter.parameters, sizeof (HGLOBAL *)) &&
+	         (*size = GlobalSize (*(HGLOBAL *) filter.parameters)) > 0)
+		return PSPI_PARAMETERS_HGLOBAL_PTR;
+
+	*size = 0;
+	return PSPI_PARAMETERS_NONE;
+}
+
+static gpointer
+parameters_lock (gint kind)
+{
+	switch (kind)
+		{
+		case PSPI_PARAMETERS_HANDLE:
+			return handle_lock_proc ((Handle) filter.parameters, TRUE);
+		case PSPI_PARAMETERS_HGLOBAL:
+			return GlobalLock ((HGLOBAL) filter.parameters);
+		case PSPI_PARAMETERS_HGLOBAL_PTR:
+			return GlobalLock (*(HGLOBAL *) filter.parameters);
+		}
+	return NULL;
+}
+
+static void
+parameters_unlock (gint kind)
+{
+	switch (kind)
+		{
+		case PSPI_PARAMETERS_HANDLE:
+			handle_unlock_proc ((Handle) filter.parameters);
+			break;
+		case PSPI_PARAMETERS_HGLOBAL:
+			GlobalUnlock ((HGLOBAL) filter.parameters);
+			break;
+		case PSPI_PARAMETERS_HGLOBAL_PTR:
+			GlobalUnlock (*(HGLOBAL *) filter.parameters);
+			break;
+		}
+}
+
+/* Allocations that must outlive the run: the parameters and data
+ * the plug-in gets back next time, and whatever is reachable from
+ * them. Built by reclaim_keep_build().
+ */
+static GHashTable *reclaim_keep = NULL;
+
+/* Handles by the address of their data, for plug-ins that keep the
+ * dereferenced pointer instead of the handle, and live buffers by
+ * the address the plug-in got.
+ */
+static GHashTable *handle_data = NULL;
+static GHashTable *buffer_data = NULL;
+
+static void
+handle_data_add (gpointer key,
+                 gpointer value,
+                 gpointer user_data)
+{
+	PspiHandle *h = key;
+
+	if (h->pointer != NULL)
+		g_hash_table_insert (handle_data, h->pointer, h);
+}
+
+/* If p is one of our allocations, or the data of a handle, mark it
+ * to be kept and queue its contents for scanning.
+ */
+static void
+reclaim_keep_add (gconstpointer p,
+                  GPtrArray    *pending)
+{
+	PspiHandle *h = NULL;
+	PspiBlock *block;
+	PspiBuffer *b;
+	gconstpointer contents = NULL;
+	gsize size = 0;
+
+	if (p == NULL || g_hash_table_lookup (reclaim_keep, p) != NULL)
+		return;
+
+	if (handle_valid ((Handle) p))
+		h = (PspiHandle *) p;
+	else if ((h = g_hash_table_lookup (handle_data, p)) != NULL)
+		;
+	else if (blocks != NULL && (block = g_hash_table_lookup (blocks, p)) != NULL)
+		{
+			contents = p;
+			size = block->size;
+		}
+	else if ((b = g_hash_table_lookup (buffer_data, p)) != NULL)
+		{
+			contents = p;
+			size = b->size;
+		}
+	else
+		return;
+
+	if (h != NULL)
+		{
+			if (g_hash_table_lookup (reclaim_keep, h) != NULL)
+				return;
+			g_hash_table_insert (reclaim_keep, h, h);
+			contents = h->pointer;
+			size = h->size;
+		}
+	g_hash_table_insert (reclaim_keep, (gpointer) p, (gpointer) p);
+
+	if (contents != NULL && size >= sizeof (gpointer))
+		{
+			g_ptr_array_add (pending, (gpointer) contents);
+			g_ptr_array_add (pending, GSIZE_TO_POINTER (size));
+		}
+}
+
+/* Any pointer-sized word in the block might point to an allocation */
+static void
+reclaim_keep_scan (gconstpointer contents,
+                   gsize         size,
+                   GPtrArray    *pending)
+{
+	gsize i;
+
+	for (i = 0; i + sizeof (gpointer) <= size; i += sizeof (gpointer))
+		{
+			gpointer word;
+
+			memcpy (&word, (const gchar *) contents + i, sizeof (gpointer));
+			reclaim_keep_add (word, pending);
+		}
+}
+
+static void
+reclaim_keep_build (void)
+{
+	GPtrArray *pending = g_ptr_array_new ();
+	PspiBuffer *b;
+	gint kind, size;
+	guint i;
+
+	reclaim_keep = g_hash_table_new (NULL, NULL);
+	handle_data = g_hash_table_new (NULL, NULL);
+	for (i = 0; i < handle_slab_used; i++)
+		if (handle_slab[i].magic == PSPI_HANDLE_MAGIC)
+			handle_data_add (handle_slab + i, NULL, NULL);
+	if (handles != NULL)
+		g_hash_table_foreach (handles, handle_data_add, NULL);
+	buffer_data = g_hash_table_new (NULL, NULL);
+	for (b = live_buffers; b != NULL; b = b->next)
+		g_hash_table_insert (buffer_data, (gchar *) b + BUFFER_HEADER_SIZE, b);
+
+	/* Parameters in a HGLOBAL aren't ours, but may point to what is */
+	kind = parameters_kind (&size);
+	reclaim_keep_add (filter.parameters, pending);
+	if (kind == PSPI_PARAMETERS_HGLOBAL || kind == PSPI_PARAMETERS_HGLOBAL_PTR)
+		{
+			reclaim_keep_scan (parameters_lock (kind), size, pending);
+			parameters_unlock (kind);
+		}
+	reclaim_keep_add ((gconstpointer) (gsize) data, pending);
+
+	while (pending->len > 0)
+		{
+			gsize n = GPOINTER_TO_SIZE (g_ptr_array_index (pending, pending->len - 1));
+			gconstpointer contents = g_ptr_array_index (pending, pending->len - 2);
+
+			g_ptr_array_set_size (pending, pending->len - 2);
+			reclaim_keep_scan (contents, n, pending);
+		}
+
+	g_ptr_array_free (pending, TRUE);
+	g_hash_table_destroy (handle_data);
+	g_hash_table_destroy (buffer_data);
+	handle_data = buffer_data = NULL;
+}
+
+static gboolean
+reclaim_exempt (gconstpointer p)
+{
+	return g_hash_table_lookup (reclaim_keep, p) != NULL;
+}
+
+/* Whether an allocation is to be reclaimed, given its owner and the
+ * library being reclaimed for, NULL for all.
+ */
+static gboolean
+reclaim_owned (gpointer allocation_owner,
+               gpointer owner)
+{
+	return owner == NULL || allocation_owner == owner;
+}
+
+typedef struct
+{
+	gpointer owner;
+	gsize count, bytes;
+} ReclaimStats;
+
+static gboolean
+reclaim_handle (gpointer key,
+                gpointer value,
+                gpointer user_data)
+{
+	PspiHandle *h = key;
+	ReclaimStats *leaked = user_data;
+
+	if (reclaim_exempt (h) || !reclaim_owned (h->owner, leaked->owner))
+		return FALSE;
+
+	leaked->count++;
+	leaked->bytes += h->size;
+	handle_data_free (h);
+	g_free (h);
+
+	return TRUE;
+}
+
+static gboolean
+reclaim_block (gpointer key,
+               gpointer value,
+               gpointer user_data)
+{
+	PspiBlock *b = value;
+	ReclaimStats *leaked = user_data;
+
+	if (reclaim_exempt (key) || !reclaim_owned (b->owner, leaked->owner))
+		return FALSE;
+
+	leaked->count++;
+	leaked->bytes += b->size;
+	memory_free (PSPI_MEMORY_BLOCKS, b->size);
+	g_free (key);
+
+	return TRUE;
+}
+
+/* Free what the plug-in got through the suites and didn't give back,
+ * so that many runs in one process don't add up. Only what was
+ * allocated for the given library, unless it is NULL.
+ */
+static void
+reclaim_allocations (gpointer owner)
+{
+	ReclaimStats leaked = { owner, 0, 0 };
+	PspiBuffer *b, *next;
+	guint i;
+
+	reclaim_keep_build ();
+
+	for (i = 0; i < handle_slab_used; i++)
+		{
+			PspiHandle *h = handle_slab + i;
+
+			if (h->magic == PSPI_HANDLE_MAGIC && !reclaim_exempt (h) &&
+			        reclaim_owned (h->owner, owner))
+				{
+					leaked.count++;
+					leaked.bytes += h->size;
+					handle_data_free (h);
+					handle_free (h);
+				}
+		}
+	if (handles != NULL)
+		g_hash_table_foreach_remove (handles, reclaim_handle, &leaked);
+
+	for (b = live_buffers; b != NULL; b = next)
+		{
+			next = b->next;
+			if (!reclaim_exempt ((gchar *) b + BUFFER_HEADER_SIZE) &&
+			        reclaim_owned (b->owner, owner))
+				{
+					leaked.count++;
+					leaked.bytes += buffer_class_size (b->size_class);
+					buffer_free_proc ((BufferID) ((gchar *) b + BUFFER_HEADER_SIZE));
+				}
 		}
+
+	if (blocks != NULL)
+		g_hash_table_foreach_remove (blocks, reclaim_block, &leaked);
+
+	/* Addresses may be reused for something else next time */
+	if (foreign_handles != NULL)
+		g_hash_table_remove_all (foreign_handles);
+
+	g_hash_table_destroy (reclaim_keep);
+	reclaim_keep = NULL;
+
+	PSPI_DEBUG (MEMORY, g_print ("pspi: reclaimed %lu leaked allocations, %lu bytes\n",
+	                             (gulong) leaked.count, (gulong) leaked.bytes));
 }
 
 static GimpPDBStatusType
 load_dll (PSPlugInEntry *pspie)
 {
+	/* Loaded by pspi_params() already, or kept by the resident host,
+	 * unless we are invoked with "re-run last filter".
+	 */
 	if (pspie->entry != NULL)
-		return GIMP_PDB_SUCCESS;
+		{
+			alloc_owner = pspie->entry->dll;
+			return GIMP_PDB_SUCCESS;
+		}
 
-	/* We are invoked with "re-run last filter" */
 	pspie->entry = g_new (PIentrypoint, 1);
 
 	if ((pspie->entry->dll = LoadLibrary (pspie->pspi->location)) == NULL)
@@ -1975,11 +4358,14 @@ load_dll (PSPlugInEntry *pspie)
 			g_message (_("pspi: LoadLibrary(%s) failed: %s"),
 			           pspie->pspi->location,
 			           g_win32_error_message (GetLastError ()));
+			g_free (pspie->entry);
+			pspie->entry = NULL;
 			return GIMP_PDB_EXECUTION_ERROR;
 		}
 
 	pspie->entry->ep = (int (CALLBACK *)(short, void *, long *, int16*))
 	                   GetProcAddress (pspie->entry->dll, pspie->entrypoint_name);
+	alloc_owner = pspie->entry->dll;
 
 	if (pspie->entry->ep == NULL)
 		{
@@ -1987,68 +4373,178 @@ load_dll (PSPlugInEntry *pspie)
 			           pspie->pspi->location, pspie->entrypoint_name,
 			           g_win32_error_message (GetLastError ()));
 			FreeLibrary (pspie->entry->dll);
+			g_free (pspie->entry);
+			pspie->entry = NULL;
 			return GIMP_PDB_EXECUTION_ERROR;
 		}
 	return GIMP_PDB_SUCCESS;
 }
 
+/* Whether another resident entry point is in the same library */
+static gboolean
+resident_shares_dll (PSPlugInEntry *pspie)
+{
+	GList *l;
+
+	for (l = resident_entries; l != NULL; l = l->next)
+		if (l->data != pspie &&
+		        ((PSPlugInEntry *) l->data)->entry->dll == pspie->entry->dll)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Size of a loaded module, from its PE header */
+static gsize
+module_size (HMODULE dll)
+{
+	const IMAGE_DOS_HEADER *dos = (const IMAGE_DOS_HEADER *) dll;
+	const IMAGE_NT_HEADERS *nt =
+	    (const IMAGE_NT_HEADERS *) ((const guchar *) dll + dos->e_lfanew);
+
+	return nt->OptionalHeader.SizeOfImage;
+}
+
+static gsize
+resident_budget (void)
+{
+	static gint budget = 0;
+
+	if (budget == 0)
+		{
+			gchar *value = gimp_gimprc_query (PSPI_RESIDENT_BUDGET_TOKEN);
+
+			if (value == NULL || (budget = atoi (value)) <= 0)
+				budget = RESIDENT_BUDGET_DEFAULT;
+			g_free (value);
+		}
+
+	return MIN ((guint64) budget << 20, G_MAXSIZE);
+}
+
+/* Keep the library of the entry loaded, and unload the least recently
+ * used ones beyond the budget. Entry points in the same file are
+ * counted separately.
+ */
 static void
-save_stuff (const PSPlugInEntry *pspie)
+resident_keep (PSPlugInEntry *pspie)
 {
-	gchar *token;
+	GList *l, *prev;
+	gsize total = 0;
+
+	resident_entries = g_list_remove (resident_entries, pspie);
+	resident_entries = g_list_prepend (resident_entries, pspie);
+
+	for (l = resident_entries; l != NULL; l = l->next)
+		total += module_size (((PSPlugInEntry *) l->data)->entry->dll);
+
+	l = g_list_last (resident_entries);
+	while (total > resident_budget () && l->data != pspie)
+		{
+			PSPlugInEntry *old = l->data;
+
+			PSPI_DEBUG (CALL, g_print ("Unloading %s\n", old->pdb_name));
+			total -= module_size (old->entry->dll);
+			/* What the library allocated goes with it, unless another
+			 * entry point in it is still kept loaded.
+			 */
+			if (!resident_shares_dll (old))
+				reclaim_allocations (old->entry->dll);
+			FreeLibrary (old->entry->dll);
+			g_free (old->entry);
+			old->entry = NULL;
+
+			prev = l->prev;
+			resident_entries = g_list_delete_link (resident_entries, l);
+			l = prev;
+		}
+}
+
+static void
+unload_dll (PSPlugInEntry *pspie)
+{
+	if (resident)
+		resident_keep (pspie);
+	else
+		FreeLibrary (pspie->entry->dll);
+}
+
+/* Allocate filter.parameters the way the plug-in did, and return it
+ * locked for filling in.
+ */
+static gpointer
+parameters_new (gint kind,
+                gint size)
+{
+	switch (kind)
+		{
+		case PSPI_PARAMETERS_HANDLE:
+			filter.parameters = handle_new_proc (size);
+			break;
+		case PSPI_PARAMETERS_HGLOBAL:
+			filter.parameters = GlobalAlloc (GMEM_MOVEABLE, size);
+			break;
+		case PSPI_PARAMETERS_HGLOBAL_PTR:
+			filter.parameters = (Handle) g_new (HGLOBAL, 1);
+			*((HGLOBAL *) filter.parameters) = GlobalAlloc (GMEM_MOVEABLE, size);
+			break;
+		default:
+			filter.parameters = NULL;
+		}
+	PSPI_DEBUG (CALL, g_print ("New parameters: kind %d, %d bytes: %p\n",
+	                           kind, size, filter.parameters));
+
+	return parameters_lock (kind);
+}
+
+/* What is kept with gimp_set_data() for "Repeat last filter", followed
+ * by the parameter block. Everything goes in one slot so that
+ * restoring costs just two calls to GIMP.
+ */
+typedef struct
+{
+	guint timestamp;	/* Of the plug-in file, to catch updates */
+	int32 data;
+	gint pid;		/* data is only good in the same process */
+	gsize module;		/* ... and library instance */
+	gint kind;
 	gint size;
+} LastVals;
 
-	if (filter.parameters != NULL)
+static void
+save_stuff (const PSPlugInEntry *pspie)
+{
+	LastVals *last;
+	gchar *token;
+	gint kind, size;
+
+	kind = parameters_kind (&size);
+	last = g_malloc (sizeof (LastVals) + size);
+	last->timestamp = pspie->pspi->timestamp;
+	last->data = data;
+	last->pid = getpid ();
+	last->module = (gsize) pspie->entry->dll;
+	last->kind = kind;
+	last->size = size;
+	if (size > 0)
 		{
-			if (handle_valid (filter.parameters))
-				{
-					token = g_strdup_printf (PSPI_PARAMETER_TOKEN, pspie->pdb_name);
-					size = handle_get_size_proc ((Handle) filter.parameters);
-					PSPI_DEBUG (CALL, g_print ("Saving parameters: %d bytes\n", size));
-					gimp_set_data (token,
-					               handle_lock_proc ((Handle) filter.parameters, TRUE),
-					               size);
-					g_free (token);
-					handle_unlock_proc ((Handle) filter.parameters);
-				}
-			else if ((size = GlobalSize ((HGLOBAL) filter.parameters)) > 0)
-				{
-					token = g_strdup_printf (PSPI_PARAMETER_HGLOBAL_TOKEN,
-					                         pspie->pdb_name);
-					PSPI_DEBUG (CALL,
-					            g_print ("Saving HGLOBAL parameters: %p %d bytes\n",
-					                     filter.parameters, size));
-					gimp_set_data (token,
-					               GlobalLock ((HGLOBAL) filter.parameters),
-					               size);
-					g_free (token);
-					GlobalUnlock ((HGLOBAL) filter.parameters);
-				}
-			else if (!IsBadReadPtr (filter.parameters, sizeof (HGLOBAL *)) &&
-			         (size = GlobalSize (*(HGLOBAL *) filter.parameters)) > 0)
-				{
-					token = g_strdup_printf (PSPI_PARAMETER_HGLOBAL_PTR_TOKEN, pspie->pdb_name);
-					PSPI_DEBUG (CALL,
-					            g_print ("Saving HGLOBAL* parameters: %p %d bytes\n",
-					                     *(HGLOBAL *) filter.parameters, size));
-					gimp_set_data (token,
-					               GlobalLock (*(HGLOBAL *) filter.parameters),
-					               size);
-					g_free (token);
-					GlobalUnlock (*(HGLOBAL *) filter.parameters);
-				}
+			memcpy (last + 1, parameters_lock (kind), size);
+			parameters_unlock (kind);
 		}
 
-	PSPI_DEBUG (CALL, g_print ("Saving data %#lx\n", data));
-	token = g_strdup_printf (PSPI_DATA_TOKEN, pspie->pdb_name);
-	size = gimp_set_data (token, &data, sizeof (int32));
+	PSPI_DEBUG (CALL, g_print ("Saving parameters: kind %d, %d bytes, data %#lx\n",
+	                           kind, size, data));
+	token = g_strdup_printf (PSPI_LAST_VALS_TOKEN, pspie->pdb_name);
+	gimp_set_data (token, last, sizeof (LastVals) + size);
 	g_free (token);
+	g_free (last);
 }
 
 static void
 restore_stuff (const PSPlugInEntry *pspie)
 {
-	gchar *token, *token2, *token3;
+	LastVals *last;
+	gchar *token;
 	gint size;
 
 	/* If this is not re-application of last filter, just keep whatever there
@@ -2057,58 +4553,197 @@ restore_stuff (const PSPlugInEntry *pspie)
 	if (prev_phase == PARAMETERS)
 		return;
 
-	token = g_strdup_printf (PSPI_PARAMETER_TOKEN, pspie->pdb_name);
-	token2 = g_strdup_printf (PSPI_PARAMETER_HGLOBAL_TOKEN, pspie->pdb_name);
-	token3 = g_strdup_printf (PSPI_PARAMETER_HGLOBAL_PTR_TOKEN, pspie->pdb_name);
+	filter.parameters = NULL;
+	data = 0;
 
-	if ((size = gimp_get_data_size (token)) > 0)
+	token = g_strdup_printf (PSPI_LAST_VALS_TOKEN, pspie->pdb_name);
+	size = gimp_get_data_size (token);
+	if (size < (gint) sizeof (LastVals))
 		{
-			PSPI_DEBUG (CALL, g_print ("Restoring parameters: %d bytes\n", size));
-			filter.parameters = handle_new_proc (size);
-			gimp_get_data (token,
-			               handle_lock_proc ((Handle) filter.parameters, TRUE));
-			handle_unlock_proc ((Handle) filter.parameters);
+			g_free (token);
+			return;
 		}
-	else if ((size = gimp_get_data_size (token2)) > 0)
+	last = g_malloc (size);
+	gimp_get_data (token, last);
+	g_free (token);
+
+	/* An updated plug-in might not understand its old parameters */
+	if (last->timestamp == pspie->pspi->timestamp &&
+	        last->kind >= PSPI_PARAMETERS_NONE &&
+	        last->kind <= PSPI_PARAMETERS_HGLOBAL_PTR &&
+	        last->size == size - (gint) sizeof (LastVals))
 		{
-			filter.parameters = GlobalAlloc (GMEM_MOVEABLE, size);
-			PSPI_DEBUG (CALL,
-			            g_print ("Restoring HGLOBAL parameters: %d bytes: %p\n",
-			                     size,
-			                     filter.parameters));
-			gimp_get_data (token2,
-			               GlobalLock ((HGLOBAL) filter.parameters));
-			GlobalUnlock ((HGLOBAL) filter.parameters);
+			if (last->kind != PSPI_PARAMETERS_NONE)
+				{
+					memcpy (parameters_new (last->kind, last->size),
+					        last + 1, last->size);
+					parameters_unlock (last->kind);
+				}
+			/* data is most likely a pointer, useless unless the
+			 * library is still loaded from when it was saved.
+			 */
+			if (last->pid == getpid () &&
+			        last->module == (gsize) pspie->entry->dll)
+				data = last->data;
+			PSPI_DEBUG (CALL, g_print ("Restored parameters: kind %d, %d bytes, data %#lx\n",
+			                           last->kind, last->size, data));
+		}
+	else
+		PSPI_DEBUG (CALL, g_print ("Ignoring parameters saved for another version of %s\n",
+		                           pspie->pspi->location));
+	g_free (last);
+}
+
+/* Store the parameters of the last filterSelectorParameters under a
+ * name, for running the filter later without its dialog.
+ */
+GimpPDBStatusType
+pspi_save_preset (PSPlugInEntry *pspie,
+                  const gchar   *name)
+{
+	PspiPreset preset;
+	gint size;
+	gboolean ok;
+
+	g_assert (prev_phase == PARAMETERS);
+
+	preset.kind = parameters_kind (&size);
+	preset.size = size;
+	preset.blob = parameters_lock (preset.kind);
+	ok = preset_save (pspie->pdb_name, name, &preset);
+	parameters_unlock (preset.kind);
+
+	return (ok ? GIMP_PDB_SUCCESS : GIMP_PDB_EXECUTION_ERROR);
+}
+
+static void
+parameters_free (gint kind)
+{
+	switch (kind)
+		{
+		case PSPI_PARAMETERS_HANDLE:
+			handle_dispose_proc ((Handle) filter.parameters);
+			break;
+		case PSPI_PARAMETERS_HGLOBAL:
+			GlobalFree ((HGLOBAL) filter.parameters);
+			break;
+		case PSPI_PARAMETERS_HGLOBAL_PTR:
+			GlobalFree (*(HGLOBAL *) filter.parameters);
+			break;
 		}
-	else if ((size = gimp_get_data_size (token3)) > 0)
+	filter.parameters = NULL;
+}
+
+/* Install parameters from elsewhere than filterSelectorParameters */
+static void
+use_parameters (gint          kind,
+                const guint8 *blob,
+                gint          size)
+{
+	setup_suites ();
+	setup_filter_record ();
+
+	if (kind != PSPI_PARAMETERS_NONE)
 		{
-			filter.parameters = (Handle) g_new (HGLOBAL, 1);
-			*((HGLOBAL *) filter.parameters) = GlobalAlloc (GMEM_MOVEABLE, size);
-			PSPI_DEBUG (CALL,
-			            g_print ("Restoring HGLOBAL* parameters: %d bytes: %p\n",
-			                     size,
-			                     *(HGLOBAL *) filter.parameters));
-			gimp_get_data (token3,
-			               GlobalLock (*(HGLOBAL *) filter.parameters));
-			GlobalUnlock (*(HGLOBAL *) filter.parameters);
+			memcpy (parameters_new (kind, size), blob, size);
+			parameters_unlock (kind);
 		}
 	else
 		filter.parameters = NULL;
+	data = 0;
 
-	g_free (token);
-	g_free (token2);
-	g_free (token3);
+	prev_phase = PARAMETERS;
+}
 
-	token = g_strdup_printf (PSPI_DATA_TOKEN, pspie->pdb_name);
-	size = gimp_get_data_size (token);
-	if (size == sizeof (int32))
+/* Take the parameters from a named preset instead of calling
+ * filterSelectorParameters.
+ */
+GimpPDBStatusType
+pspi_use_preset (PSPlugInEntry *pspie,
+                 const gchar   *name)
+{
+	PspiPreset preset;
+
+	if (!preset_load (pspie->pdb_name, name, &preset))
 		{
-			gimp_get_data (token, &data);
-			PSPI_DEBUG (CALL, g_print ("Restored data %#lx\n", data));
+			g_message (_("pspi: No preset \"%s\" for %s"), name, pspie->pdb_name);
+			return GIMP_PDB_EXECUTION_ERROR;
 		}
-	else
-		data = 0;
-	g_free (token);
+
+	use_parameters (preset.kind, preset.blob, preset.size);
+	g_free (preset.blob);
+
+	return GIMP_PDB_SUCCESS;
+}
+
+/* The parameters are passed to and from pspi_run serialized as the
+ * kind, 32 bits big-endian, followed by the parameter block.
+ */
+GimpPDBStatusType
+pspi_set_parameters (PSPlugInEntry *pspie,
+                     const guint8  *parameters,
+                     gint           size)
+{
+	guint32 kind;
+
+	if (size < 4)
+		return GIMP_PDB_CALLING_ERROR;
+
+	memcpy (&kind, parameters, 4);
+	kind = GUINT32_FROM_BE (kind);
+	if (kind > PSPI_PARAMETERS_HGLOBAL_PTR)
+		return GIMP_PDB_CALLING_ERROR;
+
+	PSPI_DEBUG (CALL, g_print ("Parameters for %s: kind %u, %d bytes\n",
+	                           pspie->pdb_name, kind, size - 4));
+	use_parameters (kind, parameters + 4, size - 4);
+
+	return GIMP_PDB_SUCCESS;
+}
+
+guint8 *
+pspi_get_parameters (gint *size)
+{
+	gint kind, n;
+	guint32 be_kind;
+	guint8 *result;
+
+	kind = parameters_kind (&n);
+	result = g_malloc (4 + n);
+	be_kind = GUINT32_TO_BE (kind);
+	memcpy (result, &be_kind, 4);
+	if (n > 0)
+		{
+			memcpy (result + 4, parameters_lock (kind), n);
+			parameters_unlock (kind);
+		}
+	*size = 4 + n;
+
+	return result;
+}
+
+/* Called by the resident host, which runs filters back to back */
+void
+pspi_set_resident (void)
+{
+	resident = TRUE;
+}
+
+/* Forget what belonged to the run just finished. The parameters have
+ * been saved for "Repeat last filter" by then.
+ */
+void
+pspi_session_end (void)
+{
+	gint size;
+
+	parameters_free (parameters_kind (&size));
+	data = 0;
+	alloc_owner = NULL;
+	prev_phase = NONE;
+	colors_current = FALSE;
+	resources_discard ();
+	image_props_clear ();
 }
 
 GimpPDBStatusType
@@ -2126,7 +4761,7 @@ pspi_about (PSPlugInEntry *pspie)
 
 	platform.hwnd = 0;
 	about.platformData = &platform;
-	about.sSPBasic = NULL /* basic_suite */;
+	about.sSPBasic = basic_suite;
 	about.plugInRef = NULL;
 	memset (about.reserved, 0, sizeof (about.reserved));
 
@@ -2178,7 +4813,7 @@ pspi_params (PSPlugInEntry *pspie)
 	                           result));
 	if (result != noErr)
 		{
-			FreeLibrary (pspie->entry->dll);
+			unload_dll (pspie);
 			return error_message (result, "filterSelectorParameters");
 		}
 
@@ -2189,6 +4824,17 @@ pspi_params (PSPlugInEntry *pspie)
 	return GIMP_PDB_SUCCESS;
 }
 
+/* Tell why a filter that came back after being asked to stop failed.
+ * One that doesn't come back is terminated by the watchdog instead.
+ */
+static void
+report_stopped (const PSPlugInEntry *pspie)
+{
+	if (abort_proc ())
+		g_message (_("pspi: %s took too long and was stopped"),
+		           strrchr (pspie->menu_path, '/') + 1);
+}
+
 GimpPDBStatusType
 pspi_prepare (PSPlugInEntry *pspie,
               GimpDrawable  *dr)
@@ -2200,15 +4846,31 @@ pspi_prepare (PSPlugInEntry *pspie,
 	/* Set globals, yecch */
 	drawable = dr;
 	image_id = gimp_drawable_get_image (drawable->drawable_id);
+	image_props_snapshot ();
 
 	image_type = gimp_drawable_type (drawable->drawable_id);
+	in_place = pspie->in_place;
+	compare_output = pspie->compare_output;
+
+#ifdef HAVE_GEGL
+	/* Always 8 bits per plane, whatever the precision of the drawable */
+	pixel_bpp = (gimp_drawable_is_rgb (drawable->drawable_id) ? 3 : 1) +
+	            (gimp_drawable_has_alpha (drawable->drawable_id) ? 1 : 0);
+#else
+	pixel_bpp = drawable->bpp;
+#endif
 
 	if ((status = load_dll (pspie)) != GIMP_PDB_SUCCESS)
 		return status;
 
 	setup_suites ();
 	setup_filter_record ();
+	setup_tile_sizes (tune_tile_size > 0 ? tune_tile_size : pspie->tile_size);
 	setup_sizes ();
+	setup_tile_cache (pspie->access_profile);
+	selector_limit = selector_time_limit (pspie);
+	memory_reset_peaks ();
+	reset_dirty ();
 
 	restore_stuff (pspie);
 
@@ -2281,13 +4943,17 @@ pspi_prepare (PSPlugInEntry *pspie,
 	result = noErr;
 	PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: calling filterSelectorPrepare\n",
 	                           __FUNCTION__));
+	g_atomic_int_set (&abort_requested, FALSE);
+	selector_watch (pspie, "filterSelectorPrepare");
 	(*pspie->entry->ep) (filterSelectorPrepare, &filter, &data, &result);
+	selector_done ();
 	PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: after filterSelectorPrepare: %d\n",
 	                           __FUNCTION__,
 	                           result));
 	if (result != noErr)
 		{
-			FreeLibrary (pspie->entry->dll);
+			unload_dll (pspie);
+			report_stopped (pspie);
 			return error_message (result, "filterSelectorPrepare");
 		}
 
@@ -2296,25 +4962,67 @@ pspi_prepare (PSPlugInEntry *pspie,
 	return GIMP_PDB_SUCCESS;
 }
 
+/* Clean up after the filter run, successful or not. Resources the
+ * plug-in changed are only stored if it succeeded.
+ */
+static void
+end_apply (PSPlugInEntry *pspie,
+           gboolean       success)
+{
+	watchdog_disarm ();
+	advance_state_reset ();
+	close_pixels ();
+	unload_dll (pspie);
+
+	/* When autotuning, and in the resident host, the library stays
+	 * loaded and may still use what it allocated. The host reclaims
+	 * it when unloading the library.
+	 */
+	if (!dry_run)
+		{
+			if (success)
+				resources_flush ();
+			else
+				resources_discard ();
+			if (!resident)
+				reclaim_allocations (NULL);
+			memory_report (pspie);
+		}
+	else
+		resources_discard ();
+	buffer_pool_flush ();
+}
+
 GimpPDBStatusType
-pspi_apply (const PSPlugInEntry *pspie,
-            GimpDrawable        *dr)
+pspi_apply (PSPlugInEntry *pspie,
+            GimpDrawable  *dr)
 {
 	int16 result;
 
 	g_assert (drawable == dr);
 	g_assert (prev_phase == PREPARE);
 
+	/* Nothing may be left over from an earlier run in this process */
+	g_assert (!src_valid && !dst_valid && outOrig == NULL);
+	g_assert (filter.inData == NULL && filter.outData == NULL);
+
+	open_pixels ();
+	start_run (pspie);
+	watchdog_arm ((gint64) time_limit () * G_USEC_PER_SEC);
+
 	result = noErr;
 	PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: calling filterSelectorStart\n",
 	                           __FUNCTION__));
+	selector_watch (pspie, "filterSelectorStart");
 	(*pspie->entry->ep) (filterSelectorStart, &filter, &data, &result);
+	selector_done ();
 	PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: after filterSelectorStart: %d\n",
 	                           __FUNCTION__,
 	                           result));
 	if (result != noErr)
 		{
-			FreeLibrary (pspie->entry->dll);
+			end_apply (pspie, FALSE);
+			report_stopped (pspie);
 			return error_message (result, "filterSelectorStart");
 		}
 
@@ -2326,11 +5034,25 @@ pspi_apply (const PSPlugInEntry *pspie,
 			result = noErr;
 			PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: calling filterSelectorContinue\n",
 			                           __FUNCTION__));
+			selector_watch (pspie, "filterSelectorContinue");
 			(*pspie->entry->ep) (filterSelectorContinue, &filter, &data, &result);
+			selector_done ();
 			PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: after filterSelectorContinue: %d\n",
 			                           __FUNCTION__,
 			                           result));
 
+			/* Plug-ins that don't poll abortProc themselves get
+			 * stopped here.
+			 */
+			if (result == noErr && abort_proc ())
+				result = userCanceledErr;
+
+#ifdef PSPI_WITH_DEBUGGING
+			/* To check that a failed trial leaves the real run clean */
+			if (result == noErr && dry_run && getenv ("PSPI_FAIL_AUTOTUNE") != NULL)
+				result = filterBadParameters;
+#endif
+
 			if (result != noErr)
 				{
 					int16 saved_result = result;
@@ -2338,14 +5060,18 @@ pspi_apply (const PSPlugInEntry *pspie,
 					result = noErr;
 					PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: calling filterSelectorFinish\n",
 					                           __FUNCTION__));
+					selector_watch (pspie, "filterSelectorFinish");
 					(*pspie->entry->ep) (filterSelectorFinish, &filter, &data, &result);
+					selector_done ();
 					PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: after filterSelectorFinish: %d\n",
 					                           __FUNCTION__,
 					                           result));
-					FreeLibrary (pspie->entry->dll);
+					end_apply (pspie, FALSE);
+					report_stopped (pspie);
 					return error_message (saved_result, "filterSelectorContinue");
 				}
 		}
+	watchdog_disarm ();
 	advance_state_proc ();
 
 #if 0
@@ -2353,17 +5079,113 @@ pspi_apply (const PSPlugInEntry *pspie,
 	result = noErr;
 	PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: calling filterSelectorFinish\n",
 	                           __FUNCTION__));
+	selector_watch (pspie, "filterSelectorFinish");
 	(*pspie->entry->ep) (filterSelectorFinish, &filter, &data, &result);
+	selector_done ();
 	PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: after filterSelectorFinish: %d\n",
 	                           __FUNCTION__,
 	                           result));
 	if (result != noErr)
 		{
-			FreeLibrary (pspie->entry->dll);
+			end_apply (pspie, FALSE);
 			return error_message (result, "filterSelectorFinish");
 		}
 #endif
 
-	FreeLibrary (pspie->entry->dll);
+	report_tile_cache ();
+	end_apply (pspie, TRUE);
+	finish_run (pspie);
+	learn_access_profile (pspie);
 	return GIMP_PDB_SUCCESS;
 }
+
+/* One run of the filter for autotuning, with the given tile size */
+static GimpPDBStatusType
+autotune_run (PSPlugInEntry *pspie,
+              GimpDrawable  *dr,
+              gint           size,
+              GTimer        *timer)
+{
+	GimpPDBStatusType status;
+
+	/* pspi_apply() frees the library when done, so hold an extra
+	 * reference for the trial run.
+	 */
+	if (!resident)
+		LoadLibrary (pspie->pspi->location);
+
+	tune_tile_size = size;
+	g_timer_start (timer);
+	if ((status = pspi_prepare (pspie, dr)) == GIMP_PDB_SUCCESS)
+		status = pspi_apply (pspie, dr);
+	g_timer_stop (timer);
+
+	return status;
+}
+
+/* Try the filter with each candidate tile size on a sample of the
+ * drawable, without storing the result, and remember the fastest
+ * size in pspirc. Uses the parameters of the last run. If the filter
+ * fails on the sample, it gets the default tile size.
+ */
+GimpPDBStatusType
+pspi_autotune (PSPlugInEntry *pspie,
+               GimpDrawable  *dr)
+{
+	static const gint sizes[] = { 64, 128, 256, 512, 1024 };
+	GimpPDBStatusType status = GIMP_PDB_SUCCESS;
+	GTimer *timer = g_timer_new ();
+	gdouble elapsed, size_elapsed, best_elapsed = 0;
+	gint i, j, best = 0;
+
+	if ((status = load_dll (pspie)) != GIMP_PDB_SUCCESS)
+		return status;
+
+	dry_run = TRUE;
+
+	/* The first run pays for the library setting itself up and for
+	 * reading the pixels into the tile cache; don't count it.
+	 */
+	status = autotune_run (pspie, dr, sizes[0], timer);
+
+	for (i = 0; i < G_N_ELEMENTS (sizes) && status == GIMP_PDB_SUCCESS; i++)
+		{
+			/* The fastest of a few runs, the others were disturbed */
+			size_elapsed = 0;
+			for (j = 0; j < AUTOTUNE_RUNS && status == GIMP_PDB_SUCCESS; j++)
+				{
+					status = autotune_run (pspie, dr, sizes[i], timer);
+					elapsed = g_timer_elapsed (timer, NULL);
+					if (j == 0 || elapsed < size_elapsed)
+						size_elapsed = elapsed;
+				}
+			if (status != GIMP_PDB_SUCCESS)
+				break;
+
+			PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: tile size %d: %.0f us/Mpixel\n",
+			                           __FUNCTION__, sizes[i],
+			                           size_elapsed * 1e12 /
+			                           ((filter.filterRect.right - filter.filterRect.left) *
+			                            (filter.filterRect.bottom - filter.filterRect.top))));
+			if (best == 0 || size_elapsed < best_elapsed)
+				{
+					best = sizes[i];
+					best_elapsed = size_elapsed;
+				}
+		}
+	tune_tile_size = 0;
+	dry_run = FALSE;
+	g_timer_destroy (timer);
+
+	if (status != GIMP_PDB_SUCCESS)
+		{
+			PSPI_DEBUG (CALL, g_print (G_STRLOC ":%s: %s failed on the sample, not tuned\n",
+			                           __FUNCTION__, pspie->pdb_name));
+			best = gimp_tile_width ();
+		}
+
+	pspie->tile_size = best;
+	save_learned (pspie);
+
+	return status;
+}
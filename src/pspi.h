@@ -27,6 +27,23 @@
 #ifndef __PSPI_H__
 #define __PSPI_H__
 
+enum
+{
+	PSPI_MEMORY_STAGING,	/* inData and outData */
+	PSPI_MEMORY_HANDLES,
+	PSPI_MEMORY_BUFFERS,
+	PSPI_MEMORY_BLOCKS,	/* SPBasic */
+	PSPI_MEMORY_CATEGORIES
+};
+
+/* Peak memory use of the last run of a filter */
+typedef struct
+{
+	guint64 peak;
+	guint64 category_peak[PSPI_MEMORY_CATEGORIES];
+	guint allocations;
+} PspiMemoryStats;
+
 void              query_8bf    (const gchar         *file,
                                 const struct stat   *st);
 
@@ -34,10 +51,39 @@ GimpPDBStatusType pspi_about   (PSPlugInEntry *pspie);
 
 GimpPDBStatusType pspi_params  (PSPlugInEntry *pspie);
 
+GimpPDBStatusType pspi_save_preset (PSPlugInEntry *pspie,
+                                    const gchar   *name);
+
+GimpPDBStatusType pspi_use_preset  (PSPlugInEntry *pspie,
+                                    const gchar   *name);
+
+GimpPDBStatusType pspi_set_parameters (PSPlugInEntry *pspie,
+                                       const guint8  *parameters,
+                                       gint           size);
+
+guint8 *          pspi_get_parameters (gint *size);
+
+void              pspi_set_resident (void);
+
+void              pspi_session_end (void);
+
 GimpPDBStatusType pspi_prepare (PSPlugInEntry *pspie,
                                 GimpDrawable  *drawable);
 
 GimpPDBStatusType pspi_apply   (PSPlugInEntry *pspie,
                                 GimpDrawable  *drawable);
 
+GimpPDBStatusType pspi_autotune (PSPlugInEntry *pspie,
+                                 GimpDrawable  *drawable);
+
+gboolean          pspi_dirty_bounds (gint *x,
+                                     gint *y,
+                                     gint *width,
+                                     gint *height);
+
+void              pspi_update_dirty (void);
+
+gboolean          pspi_memory_stats (const gchar     *pdb_name,
+                                     PspiMemoryStats *stats);
+
 #endif /* __PSPI_H__ */